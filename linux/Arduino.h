@@ -0,0 +1,125 @@
+/**
+ * Minimal Arduino / FreeRTOS surface for building the library on Linux
+ *
+ * Only what the RTSP and MJPEG servers use is provided: String, IPAddress,
+ * millis/micros/random, portMUX critical sections and recursive mutexes.
+ * Put this directory ahead of any real Arduino core on the include path.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+long random(long howbig);
+
+class String {
+  public:
+    String() {}
+    String(const char* s) : _s(s ? s : "") {}
+    String(const std::string& s) : _s(s) {}
+    String(char c) : _s(1, c) {}
+    String(int v) : _s(std::to_string(v)) {}
+    String(unsigned int v) : _s(std::to_string(v)) {}
+    String(long v) : _s(std::to_string(v)) {}
+    String(unsigned long v) : _s(std::to_string(v)) {}
+    const char* c_str() const { return this->_s.c_str(); }
+    unsigned int length() const { return this->_s.size(); }
+    bool reserve(unsigned int size) { this->_s.reserve(size); return true; }
+    bool concat(const String& s) { this->_s += s._s; return true; }
+    String& operator+=(const String& s) { this->_s += s._s; return *this; }
+    bool operator==(const String& s) const { return this->_s == s._s; }
+    bool operator!=(const String& s) const { return this->_s != s._s; }
+    friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+
+  private:
+    std::string _s;
+};
+
+/**
+ * IPv4 address; octets are in network order, as on the ESP32
+ */
+class IPAddress {
+  public:
+    IPAddress() { memset(this->_bytes, 0, sizeof(this->_bytes)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _bytes{a, b, c, d} {}
+    explicit IPAddress(uint32_t address) { memcpy(this->_bytes, &address, 4); }
+    operator uint32_t() const { uint32_t a; memcpy(&a, this->_bytes, 4); return a; }
+    uint8_t operator[](int index) const { return this->_bytes[index]; }
+    uint8_t& operator[](int index) { return this->_bytes[index]; }
+    bool operator==(const IPAddress& o) const { return memcmp(this->_bytes, o._bytes, 4) == 0; }
+    bool operator!=(const IPAddress& o) const { return !(*this == o); }
+    bool fromString(const char* address) {
+      unsigned a, b, c, d;
+      char tail;
+      if (sscanf(address, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+        return false;
+      }
+      *this = IPAddress(a, b, c, d);
+      return true;
+    }
+    String toString() const {
+      char s[16];
+      snprintf(s, sizeof(s), "%u.%u.%u.%u", this->_bytes[0], this->_bytes[1], this->_bytes[2], this->_bytes[3]);
+      return String(s);
+    }
+
+  private:
+    uint8_t _bytes[4];
+};
+
+/**
+ * FreeRTOS style critical sections; a spinlock, since sections are a few instructions long
+ */
+struct portMUX_TYPE {
+  int locked;
+};
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+inline void portENTER_CRITICAL(portMUX_TYPE* mux) {
+  while (__atomic_exchange_n(&mux->locked, 1, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+inline void portEXIT_CRITICAL(portMUX_TYPE* mux) {
+  __atomic_store_n(&mux->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Statically allocated recursive mutexes
+ */
+typedef std::recursive_mutex* SemaphoreHandle_t;
+struct StaticSemaphore_t {
+  alignas(std::recursive_mutex) unsigned char storage[sizeof(std::recursive_mutex)];
+};
+#define portMAX_DELAY 0xffffffff
+#define pdTRUE 1
+
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t* buffer) {
+  return new (buffer->storage) std::recursive_mutex();
+}
+
+inline int xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, uint32_t /*ticks*/) {
+  semaphore->lock();
+  return pdTRUE;
+}
+
+inline int xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+  semaphore->unlock();
+  return pdTRUE;
+}
@@ -0,0 +1,99 @@
+/**
+ * epoll loop shared by the Linux AsyncTCP and WiFiUDP backends
+ */
+
+#include "AsyncLinux.h"
+#include <AsyncTCP.h>
+#include <WiFiUdp.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#ifndef ASYNC_LINUX_POLL_INTERVAL_MS
+#define ASYNC_LINUX_POLL_INTERVAL_MS 125 // AsyncTCP polls every couple of lwIP slow timer ticks
+#endif
+#define ASYNC_LINUX_MAX_EVENTS 64
+
+thread_local int asyncLinuxTransportDepth = 0;
+
+static int epollFd = -1;
+// events carry the fd rather than the handler, so a handler deleted by an
+// earlier callback in the same batch is never dereferenced
+static std::unordered_map<int, AsyncLinuxHandler*> handlers;
+static uint32_t lastPollMillis = 0;
+
+static struct timespec startTime;
+static bool startTimeSet = false;
+
+static uint64_t elapsedMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!startTimeSet) {
+    startTime = now;
+    startTimeSet = true;
+  }
+  return (uint64_t)(now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000;
+}
+
+uint32_t millis() {
+  return elapsedMicros() / 1000;
+}
+
+uint32_t micros() {
+  return elapsedMicros();
+}
+
+void delay(uint32_t ms) {
+  usleep(ms * 1000);
+}
+
+long random(long howbig) {
+  return howbig > 0 ? ::random() % howbig : 0;
+}
+
+static int getEpoll() {
+  if (epollFd < 0) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+  }
+  return epollFd;
+}
+
+bool asyncLinuxWatch(int fd, uint32_t events, AsyncLinuxHandler* handler) {
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+  AsyncLinuxTransportScope transport;
+  handlers[fd] = handler;
+  if (epoll_ctl(getEpoll(), EPOLL_CTL_MOD, fd, &ev) == 0) {
+    return true;
+  }
+  return errno == ENOENT && epoll_ctl(getEpoll(), EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void asyncLinuxUnwatch(int fd) {
+  epoll_ctl(getEpoll(), EPOLL_CTL_DEL, fd, nullptr);
+  handlers.erase(fd);
+}
+
+void asyncLinuxRun(int timeoutMs) {
+  // datagrams queued by the last tick() go out before we sleep
+  WiFiUDP::flushAll();
+
+  struct epoll_event events[ASYNC_LINUX_MAX_EVENTS];
+  int n = epoll_wait(getEpoll(), events, ASYNC_LINUX_MAX_EVENTS, timeoutMs);
+  for (int i = 0; i < n; i++) {
+    auto handler = handlers.find(events[i].data.fd);
+    if (handler != handlers.end()) {
+      handler->second->handleEvents(events[i].events);
+    }
+  }
+
+  bool poll = millis() - lastPollMillis >= ASYNC_LINUX_POLL_INTERVAL_MS;
+  if (poll) {
+    lastPollMillis = millis();
+  }
+  AsyncClient::serviceAll(poll);
+  WiFiUDP::flushAll();
+}
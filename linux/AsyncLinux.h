@@ -0,0 +1,51 @@
+/**
+ * The event loop behind the Linux AsyncTCP and WiFiUDP backends
+ *
+ * On the ESP32 AsyncTCP runs callbacks from its own task.  Here everything
+ * (socket callbacks, polls and the batched UDP sends) runs on the thread
+ * that calls asyncLinuxRun(), so call it and AsyncRTSPServer::tick() from
+ * the same loop and the library stays single threaded:
+ *
+ *   while (true) {
+ *     asyncLinuxRun(1);
+ *     server.tick();
+ *   }
+ */
+
+#pragma once
+#include <stdint.h>
+
+/**
+ * Anything registered with the epoll set
+ */
+class AsyncLinuxHandler {
+  public:
+    virtual ~AsyncLinuxHandler() {}
+    virtual void handleEvents(uint32_t events) = 0;
+};
+
+/**
+ * Nonzero while the backend is allocating for itself: connection objects,
+ * queued TCP segments, sockets, receive buffers.  That is the heap use
+ * AsyncTCP and lwIP have on the ESP32, which allocation tests of the
+ * library (rtsp_alloc_test.cpp) leave out of their count.
+ */
+extern thread_local int asyncLinuxTransportDepth;
+
+struct AsyncLinuxTransportScope {
+  AsyncLinuxTransportScope() { asyncLinuxTransportDepth++; }
+  ~AsyncLinuxTransportScope() { asyncLinuxTransportDepth--; }
+};
+
+/**
+ * Add fd to the epoll set, or change the events it is watched for
+ */
+bool asyncLinuxWatch(int fd, uint32_t events, AsyncLinuxHandler* handler);
+void asyncLinuxUnwatch(int fd);
+
+/**
+ * Flush batched UDP datagrams, wait up to timeoutMs for socket events and
+ * dispatch them, then deliver pending ACKs and (every
+ * ASYNC_LINUX_POLL_INTERVAL_MS) poll callbacks
+ */
+void asyncLinuxRun(int timeoutMs);
@@ -0,0 +1,465 @@
+/**
+ * AsyncServer / AsyncClient on non-blocking sockets; see AsyncTCP.h
+ */
+
+#include <AsyncTCP.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#define ASYNC_LINUX_MAX_IOV 64
+#define ASYNC_LINUX_READ_SIZE 4096
+
+// every open connection, for ACK delivery and polling
+static std::unordered_set<AsyncClient*> clients;
+
+AsyncClient::AsyncClient(int fd)
+{
+  AsyncLinuxTransportScope transport;
+  this->_fd = fd;
+  this->_connecting = false;
+  this->_closing = false;
+  this->_watchedEvents = 0;
+  this->_remotePort = 0;
+  this->_queueOffset = 0;
+  this->_queuedBytes = 0;
+  this->_sentSinceAck = 0;
+  this->_alive = std::make_shared<bool>(true);
+  this->_connect_cb_arg = nullptr;
+  this->_discard_cb_arg = nullptr;
+  this->_sent_cb_arg = nullptr;
+  this->_recv_cb_arg = nullptr;
+  this->_poll_cb_arg = nullptr;
+
+  if (fd >= 0) {
+    this->readRemoteAddress();
+    this->updateWatch();
+    clients.insert(this);
+  }
+}
+
+AsyncClient::~AsyncClient()
+{
+  *this->_alive = false;
+  if (this->_fd >= 0) {
+    asyncLinuxUnwatch(this->_fd);
+    ::close(this->_fd);
+  }
+  clients.erase(this);
+}
+
+void AsyncClient::readRemoteAddress()
+{
+  struct sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  if (getpeername(this->_fd, (struct sockaddr*)&addr, &len) == 0) {
+    this->_remoteIP = IPAddress((uint32_t)addr.sin_addr.s_addr);
+    this->_remotePort = ntohs(addr.sin_port);
+  }
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port)
+{
+  if (this->_fd >= 0) {
+    return false;
+  }
+  this->_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (this->_fd < 0) {
+    return false;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)ip;
+  if (::connect(this->_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    ::close(this->_fd);
+    this->_fd = -1;
+    return false;
+  }
+  this->_remoteIP = ip;
+  this->_remotePort = port;
+  this->_connecting = true;
+  this->_closing = false;
+  this->_watchedEvents = 0;
+  this->updateWatch();
+  AsyncLinuxTransportScope transport;
+  clients.insert(this);
+  return true;
+}
+
+/**
+ * Forget the socket and tell the owner; the disconnect handler
+ * may delete us, so nothing may touch this afterwards.  Like AsyncTCP,
+ * a client nobody handles is left for whoever holds it to delete
+ */
+void AsyncClient::closeSocket()
+{
+  if (this->_fd < 0) {
+    return;
+  }
+  asyncLinuxUnwatch(this->_fd);
+  ::close(this->_fd);
+  this->_fd = -1;
+  this->_connecting = false;
+  this->_queue.clear();
+  this->_queueOffset = 0;
+  this->_queuedBytes = 0;
+  clients.erase(this);
+
+  if (this->_discard_cb) {
+    this->_discard_cb(this->_discard_cb_arg, this);
+  }
+}
+
+void AsyncClient::close(bool now)
+{
+  if (!now && this->_queuedBytes > 0 && this->connected()) {
+    this->_closing = true; // flush() closes once the queue drains
+    this->flush();
+    return;
+  }
+  this->closeSocket();
+}
+
+bool AsyncClient::connected()
+{
+  return this->_fd >= 0 && !this->_connecting;
+}
+
+bool AsyncClient::canSend()
+{
+  return this->space() > 0;
+}
+
+size_t AsyncClient::space()
+{
+  if (!this->connected() || this->_closing) {
+    return 0;
+  }
+  return ASYNC_LINUX_SEND_BUFFER - min(this->_queuedBytes, (size_t)ASYNC_LINUX_SEND_BUFFER);
+}
+
+size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags)
+{
+  size = min(size, this->space());
+  if (size == 0) {
+    return 0;
+  }
+  AsyncLinuxTransportScope transport;
+  this->_queue.push_back({data, size, std::string()});
+  Segment& segment = this->_queue.back();
+  if (apiflags & ASYNC_WRITE_FLAG_COPY) {
+    segment.copy.assign(data, size);
+    segment.data = segment.copy.data();
+  }
+  this->_queuedBytes += size;
+  return size;
+}
+
+bool AsyncClient::send()
+{
+  return this->flush();
+}
+
+size_t AsyncClient::write(const char* data)
+{
+  return this->write(data, strlen(data));
+}
+
+size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags)
+{
+  size_t added = this->add(data, size, apiflags);
+  if (added > 0) {
+    this->send();
+  }
+  return added;
+}
+
+void AsyncClient::setNoDelay(bool nodelay)
+{
+  int on = nodelay ? 1 : 0;
+  setsockopt(this->_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+IPAddress AsyncClient::remoteIP()
+{
+  return this->_remoteIP;
+}
+
+uint16_t AsyncClient::remotePort()
+{
+  return this->_remotePort;
+}
+
+/**
+ * Write as much of the queue as the kernel takes in one sendmsg per
+ * ASYNC_LINUX_MAX_IOV segments.  Returns false if the connection failed.
+ */
+bool AsyncClient::flush()
+{
+  while (!this->_queue.empty() && this->connected()) {
+    struct iovec iov[ASYNC_LINUX_MAX_IOV];
+    int count = 0;
+    for (auto it = this->_queue.begin(); it != this->_queue.end() && count < ASYNC_LINUX_MAX_IOV; ++it, ++count) {
+      size_t skip = (count == 0) ? this->_queueOffset : 0;
+      iov[count].iov_base = (void*)(it->data + skip);
+      iov[count].iov_len = it->length - skip;
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t sent = sendmsg(this->_fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      // like lwIP, report the failure later from the event loop rather than
+      // firing onDisconnect from inside the caller's add()/send()
+      shutdown(this->_fd, SHUT_RDWR);
+      this->_queue.clear();
+      this->_queueOffset = 0;
+      this->_queuedBytes = 0;
+      return false;
+    }
+
+    this->_queuedBytes -= sent;
+    this->_sentSinceAck += sent;
+    size_t remaining = sent;
+    while (remaining > 0) {
+      Segment& front = this->_queue.front();
+      size_t left = front.length - this->_queueOffset;
+      if (remaining < left) {
+        this->_queueOffset += remaining;
+        break;
+      }
+      remaining -= left;
+      this->_queue.pop_front();
+      this->_queueOffset = 0;
+    }
+  }
+
+  if (this->_closing && this->_queue.empty()) {
+    this->closeSocket();
+    return true;
+  }
+  if (this->_fd >= 0) {
+    this->updateWatch();
+  }
+  return true;
+}
+
+void AsyncClient::updateWatch()
+{
+  uint32_t events = EPOLLIN | EPOLLRDHUP;
+  if (this->_connecting || !this->_queue.empty()) {
+    events |= EPOLLOUT;
+  }
+  if (events != this->_watchedEvents) {
+    asyncLinuxWatch(this->_fd, events, this);
+    this->_watchedEvents = events;
+  }
+}
+
+void AsyncClient::handleEvents(uint32_t events)
+{
+  std::shared_ptr<bool> alive = this->_alive;
+
+  if (this->_connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(this->_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+      this->closeSocket();
+      return;
+    }
+    this->_connecting = false;
+    this->updateWatch();
+    if (this->_connect_cb) {
+      this->_connect_cb(this->_connect_cb_arg, this);
+      if (!*alive || this->_fd < 0) {
+        return;
+      }
+    }
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    char buffer[ASYNC_LINUX_READ_SIZE];
+    while (this->_fd >= 0) {
+      ssize_t n = recv(this->_fd, buffer, sizeof(buffer), 0);
+      if (n > 0) {
+        if (this->_recv_cb) {
+          this->_recv_cb(this->_recv_cb_arg, this, buffer, n);
+          if (!*alive) {
+            return;
+          }
+        }
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      // orderly shutdown or a reset
+      this->closeSocket();
+      return;
+    }
+  }
+
+  if ((events & EPOLLOUT) && this->_fd >= 0) {
+    this->flush();
+  }
+}
+
+void AsyncClient::serviceAll(bool poll)
+{
+  // callbacks may delete clients (or create new ones), so work from a snapshot
+  std::vector<std::pair<AsyncClient*, std::shared_ptr<bool>>> snapshot;
+  {
+    AsyncLinuxTransportScope transport;
+    snapshot.reserve(clients.size());
+    for (AsyncClient* c : clients) {
+      snapshot.push_back({c, c->_alive});
+    }
+  }
+  for (auto& entry : snapshot) {
+    AsyncClient* c = entry.first;
+    if (*entry.second && c->_sentSinceAck > 0 && c->_sent_cb) {
+      size_t acked = c->_sentSinceAck;
+      c->_sentSinceAck = 0;
+      c->_sent_cb(c->_sent_cb_arg, c, acked, 0);
+    }
+    if (poll && *entry.second && c->connected() && c->_poll_cb) {
+      c->_poll_cb(c->_poll_cb_arg, c);
+    }
+  }
+}
+
+void AsyncClient::onConnect(AcConnectHandler cb, void* arg)
+{
+  this->_connect_cb = cb;
+  this->_connect_cb_arg = arg;
+}
+
+void AsyncClient::onDisconnect(AcConnectHandler cb, void* arg)
+{
+  this->_discard_cb = cb;
+  this->_discard_cb_arg = arg;
+}
+
+void AsyncClient::onAck(AcAckHandler cb, void* arg)
+{
+  this->_sent_cb = cb;
+  this->_sent_cb_arg = arg;
+}
+
+void AsyncClient::onData(AcDataHandler cb, void* arg)
+{
+  this->_recv_cb = cb;
+  this->_recv_cb_arg = arg;
+}
+
+void AsyncClient::onPoll(AcConnectHandler cb, void* arg)
+{
+  this->_poll_cb = cb;
+  this->_poll_cb_arg = arg;
+}
+
+AsyncServer::AsyncServer(uint16_t port)
+{
+  this->_port = port;
+  this->_fd = -1;
+  this->_noDelay = false;
+  this->_connect_cb_arg = nullptr;
+}
+
+AsyncServer::~AsyncServer()
+{
+  this->end();
+}
+
+void AsyncServer::onClient(AcConnectHandler cb, void* arg)
+{
+  this->_connect_cb = cb;
+  this->_connect_cb_arg = arg;
+}
+
+void AsyncServer::begin()
+{
+  if (this->_fd >= 0) {
+    return;
+  }
+  this->_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (this->_fd < 0) {
+    return;
+  }
+  int on = 1;
+  setsockopt(this->_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(this->_port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(this->_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(this->_fd, SOMAXCONN) < 0) {
+    ::close(this->_fd);
+    this->_fd = -1;
+    return;
+  }
+  asyncLinuxWatch(this->_fd, EPOLLIN, this);
+}
+
+void AsyncServer::end()
+{
+  if (this->_fd >= 0) {
+    asyncLinuxUnwatch(this->_fd);
+    ::close(this->_fd);
+    this->_fd = -1;
+  }
+}
+
+void AsyncServer::setNoDelay(bool nodelay)
+{
+  this->_noDelay = nodelay;
+}
+
+bool AsyncServer::getNoDelay()
+{
+  return this->_noDelay;
+}
+
+void AsyncServer::handleEvents(uint32_t)
+{
+  while (this->_fd >= 0) {
+    int fd = accept4(this->_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return; // EAGAIN, or out of descriptors; epoll will tell us again
+    }
+    AsyncClient* c;
+    {
+      AsyncLinuxTransportScope transport;
+      c = new AsyncClient(fd);
+    }
+    if (this->_noDelay) {
+      c->setNoDelay(true);
+    }
+    if (this->_connect_cb) {
+      this->_connect_cb(this->_connect_cb_arg, c);
+    }
+    else {
+      c->close(true);
+    }
+  }
+}
@@ -0,0 +1,119 @@
+/**
+ * AsyncServer / AsyncClient for Linux, on non-blocking sockets and epoll
+ *
+ * Mirrors the subset of the AsyncTCP API the library uses, with the same
+ * callback contracts: onDisconnect fires when the connection is closed from
+ * either side (and the handler owns deleting the client; without one nobody
+ * frees it), data queued with add() without ASYNC_WRITE_FLAG_COPY must stay
+ * valid until it is ACKed, and onAck reports bytes the kernel has taken off
+ * our hands.  All callbacks run from asyncLinuxRun().
+ */
+
+#pragma once
+#include <Arduino.h>
+#include <memory>
+#include <deque>
+#include "AsyncLinux.h"
+
+#ifndef ASYNC_LINUX_SEND_BUFFER
+#define ASYNC_LINUX_SEND_BUFFER 65536 // bytes queued per connection before space() reports 0
+#endif
+#define ASYNC_WRITE_FLAG_COPY 0x01
+
+class AsyncClient;
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, void* data, size_t len)> AcDataHandler;
+
+class AsyncClient : public AsyncLinuxHandler {
+  public:
+    /**
+     * Wraps an already connected socket (from AsyncServer), or creates an
+     * unconnected client for connect() when fd is -1
+     */
+    AsyncClient(int fd = -1);
+    ~AsyncClient();
+
+    bool connect(IPAddress ip, uint16_t port);
+    /**
+     * close(false) sends whatever is queued first; close(true) drops it
+     */
+    void close(bool now = false);
+    bool connected();
+    bool canSend();
+    size_t space();
+    size_t add(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+    bool send();
+    size_t write(const char* data);
+    size_t write(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+    void setNoDelay(bool nodelay);
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+    void onConnect(AcConnectHandler cb, void* arg = 0);
+    void onDisconnect(AcConnectHandler cb, void* arg = 0);
+    void onAck(AcAckHandler cb, void* arg = 0);
+    void onData(AcDataHandler cb, void* arg = 0);
+    void onPoll(AcConnectHandler cb, void* arg = 0);
+
+    void handleEvents(uint32_t events) override;
+    /**
+     * Deliver ACKs for bytes sent since the last call, and poll callbacks if
+     * poll is set; called by asyncLinuxRun for every connection
+     */
+    static void serviceAll(bool poll);
+
+  private:
+    struct Segment {
+      const char* data;
+      size_t length;
+      std::string copy; // owns the bytes when ASYNC_WRITE_FLAG_COPY was given
+    };
+    bool flush();
+    void updateWatch();
+    void closeSocket();
+    void readRemoteAddress();
+    int _fd;
+    bool _connecting;
+    bool _closing;
+    uint32_t _watchedEvents;
+    IPAddress _remoteIP;
+    uint16_t _remotePort;
+    std::deque<Segment> _queue;
+    size_t _queueOffset; // bytes of the front segment already written
+    size_t _queuedBytes;
+    size_t _sentSinceAck;
+    std::shared_ptr<bool> _alive; // cleared by the destructor, so callbacks can tell if they deleted us
+
+    AcConnectHandler _connect_cb;
+    void* _connect_cb_arg;
+    AcConnectHandler _discard_cb;
+    void* _discard_cb_arg;
+    AcAckHandler _sent_cb;
+    void* _sent_cb_arg;
+    AcDataHandler _recv_cb;
+    void* _recv_cb_arg;
+    AcConnectHandler _poll_cb;
+    void* _poll_cb_arg;
+};
+
+class AsyncServer : public AsyncLinuxHandler {
+  public:
+    AsyncServer(uint16_t port);
+    ~AsyncServer();
+    void onClient(AcConnectHandler cb, void* arg);
+    void begin();
+    void end();
+    void setNoDelay(bool nodelay);
+    bool getNoDelay();
+
+    void handleEvents(uint32_t events) override;
+
+  private:
+    uint16_t _port;
+    int _fd;
+    bool _noDelay;
+    AcConnectHandler _connect_cb;
+    void* _connect_cb_arg;
+};
@@ -0,0 +1,184 @@
+/**
+ * HTTP MJPEG client feeding AsyncRTSPServer; see MJPEGRelay.h
+ * Multipart streams: https://datatracker.ietf.org/doc/html/rfc2046#section-5.1
+ */
+
+#include "MJPEGRelay.h"
+#include <strings.h>
+
+#define MJPEG_RELAY_MAX_HEADER_SIZE 2048
+
+MJPEGRelay::MJPEGRelay(AsyncRTSPServer* server, IPAddress host, uint16_t port, const char* path)
+{
+  this->server = server;
+  this->client = nullptr;
+  this->host = host;
+  this->port = port;
+  snprintf(this->request, sizeof(this->request),
+    "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host.toString().c_str());
+  this->disconnectedMillis = millis() - MJPEG_RELAY_RECONNECT_MS;
+  this->state = ResponseHeaders;
+  this->partLength = 0;
+  this->stats = {};
+}
+
+MJPEGRelay::~MJPEGRelay()
+{
+  if (this->client != nullptr) {
+    this->client->onDisconnect(nullptr, nullptr);
+    delete this->client;
+  }
+}
+
+void MJPEGRelay::handle()
+{
+  if (this->client == nullptr && millis() - this->disconnectedMillis >= MJPEG_RELAY_RECONNECT_MS) {
+    this->connect();
+  }
+}
+
+MJPEGRelayStats MJPEGRelay::getStats()
+{
+  return this->stats;
+}
+
+void MJPEGRelay::connect()
+{
+  this->client = new AsyncClient();
+  this->state = ResponseHeaders;
+  this->headers.clear();
+  this->frame = nullptr;
+
+  this->client->onConnect([this](void*, AsyncClient* c) {
+    this->stats.connects++;
+    c->write(this->request);
+  });
+
+  this->client->onData([this](void*, AsyncClient*, void* data, size_t len) {
+    this->stats.bytesReceived += len;
+    this->handleData((const uint8_t*)data, len);
+  });
+
+  this->client->onDisconnect([this](void*, AsyncClient* c) {
+    this->client = nullptr;
+    this->disconnectedMillis = millis();
+    this->frame = nullptr;
+    delete c;
+  });
+
+  if (!this->client->connect(this->host, this->port)) {
+    delete this->client;
+    this->client = nullptr;
+    this->disconnectedMillis = millis();
+  }
+}
+
+/**
+ * Pull the header block (up to the blank line) out of this->headers;
+ * returns false until it is complete
+ */
+bool MJPEGRelay::parseHeaders()
+{
+  // parts may be separated by a bare CRLF before the boundary line
+  while (this->headers.size() >= 2 && this->headers[0] == '\r' && this->headers[1] == '\n') {
+    this->headers.erase(0, 2);
+  }
+  return this->headers.size() >= 4 && this->headers.compare(this->headers.size() - 4, 4, "\r\n\r\n") == 0;
+}
+
+void MJPEGRelay::finishFrame()
+{
+  std::shared_ptr<std::vector<uint8_t>> image = this->frame;
+  this->frame = nullptr;
+  this->state = PartHeaders;
+  this->headers.clear();
+  this->stats.framesRelayed++;
+  this->server->pushFrame(image->data(), image->size(), image);
+}
+
+void MJPEGRelay::handleData(const uint8_t* data, size_t len)
+{
+  while (len > 0) {
+    if (this->state != PartBody) {
+      // headers are short; take them a byte at a time so we stop exactly at the blank line
+      this->headers.push_back((char)*data++);
+      len--;
+      if (this->headers.size() > MJPEG_RELAY_MAX_HEADER_SIZE) {
+        this->client->close(true);
+        return;
+      }
+      if (!this->parseHeaders()) {
+        continue;
+      }
+
+      if (this->state == ResponseHeaders) {
+        if (this->headers.compare(0, 9, "HTTP/1.1 ") != 0 && this->headers.compare(0, 9, "HTTP/1.0 ") != 0) {
+          this->client->close(true);
+          return;
+        }
+        if (this->headers.compare(9, 3, "200") != 0) {
+          this->client->close(true);
+          return;
+        }
+        this->state = PartHeaders;
+        this->headers.clear();
+        continue;
+      }
+
+      // part headers: --boundary, Content-Type, and (usually) Content-Length
+      this->partLength = 0;
+      const char* h = this->headers.c_str();
+      for (const char* line = h; line != nullptr && *line; ) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+          this->partLength = strtoul(line + 15, nullptr, 10);
+        }
+        line = strstr(line, "\r\n");
+        line = line ? line + 2 : nullptr;
+      }
+      this->headers.clear();
+      this->frame = std::make_shared<std::vector<uint8_t>>();
+      if (this->partLength > MJPEG_RELAY_MAX_FRAME_SIZE) {
+        this->stats.framesDropped++;
+        this->client->close(true);
+        return;
+      }
+      this->frame->reserve(this->partLength ? this->partLength : 65536);
+      this->state = PartBody;
+      continue;
+    }
+
+    std::vector<uint8_t>& body = *this->frame;
+    if (this->partLength > 0) {
+      size_t take = min(len, this->partLength - body.size());
+      body.insert(body.end(), data, data + take);
+      data += take;
+      len -= take;
+      if (body.size() == this->partLength) {
+        this->finishFrame();
+      }
+      continue;
+    }
+
+    // no Content-Length: the part ends with the JPEG EOI marker
+    size_t scanFrom = body.empty() ? 0 : body.size() - 1;
+    body.insert(body.end(), data, data + len);
+    size_t consumed = len;
+    len = 0;
+    for (size_t i = scanFrom; i + 1 < body.size(); i++) {
+      if (body[i] == 0xff && body[i + 1] == JPEG_EndOfImage) {
+        size_t end = i + 2;
+        size_t extra = body.size() - end;
+        data = data + consumed - extra;
+        len = extra;
+        body.resize(end);
+        this->finishFrame();
+        break;
+      }
+    }
+    if (this->frame != nullptr && this->frame->size() > MJPEG_RELAY_MAX_FRAME_SIZE) {
+      this->stats.framesDropped++;
+      this->client->close(true);
+      return;
+    }
+  }
+}
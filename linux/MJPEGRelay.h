@@ -0,0 +1,59 @@
+/**
+ * Relay mode: pull an HTTP MJPEG stream (an ESP32 running AsyncMJPEGServer,
+ * or any multipart/x-mixed-replace camera) and feed each JPEG into
+ * AsyncRTSPServer::pushFrame, so one gateway can re-serve a camera to many
+ * RTSP viewers while the camera itself only ever has a single consumer.
+ */
+
+#pragma once
+#include <AsyncTCP.h>
+#include "AsyncRTSP.h"
+#include <vector>
+
+#ifndef MJPEG_RELAY_MAX_FRAME_SIZE
+#define MJPEG_RELAY_MAX_FRAME_SIZE (1024 * 1024) // parts larger than this are skipped
+#endif
+#ifndef MJPEG_RELAY_RECONNECT_MS
+#define MJPEG_RELAY_RECONNECT_MS 2000
+#endif
+
+struct MJPEGRelayStats {
+  uint32_t framesRelayed;
+  uint32_t framesDropped;     // oversized or malformed parts
+  uint32_t connects;
+  uint64_t bytesReceived;
+};
+
+class MJPEGRelay {
+  public:
+    MJPEGRelay(AsyncRTSPServer* server, IPAddress host, uint16_t port, const char* path);
+    ~MJPEGRelay();
+    /**
+     * Connect, and reconnect after MJPEG_RELAY_RECONNECT_MS whenever the
+     * camera goes away; call from the same loop as asyncLinuxRun
+     */
+    void handle();
+    MJPEGRelayStats getStats();
+
+  private:
+    enum State {
+      ResponseHeaders,
+      PartHeaders,
+      PartBody
+    };
+    void connect();
+    void handleData(const uint8_t* data, size_t len);
+    bool parseHeaders();
+    void finishFrame();
+    AsyncRTSPServer* server;
+    AsyncClient* client;
+    IPAddress host;
+    uint16_t port;
+    char request[256];
+    uint32_t disconnectedMillis;
+    State state;
+    std::string headers;
+    size_t partLength;          // Content-Length of the current part; 0 if it didn't say
+    std::shared_ptr<std::vector<uint8_t>> frame;
+    MJPEGRelayStats stats;
+};
@@ -0,0 +1,295 @@
+/**
+ * WiFiUDP on shared non-blocking sockets; see WiFiUdp.h
+ */
+
+#include <WiFiUdp.h>
+#include "AsyncLinux.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef WIFIUDP_SEND_BUFFER
+#define WIFIUDP_SEND_BUFFER (4 * 1024 * 1024)
+#endif
+
+static WiFiUDPBatchStats batchStats = {};
+
+struct WiFiUDP::Socket {
+  int fd;
+  uint16_t port;
+  int references;
+  int queued;
+  struct mmsghdr messages[WIFIUDP_BATCH_SIZE];
+  struct iovec iov[WIFIUDP_BATCH_SIZE];
+  struct sockaddr_in addresses[WIFIUDP_BATCH_SIZE];
+  uint8_t data[WIFIUDP_BATCH_SIZE][WIFIUDP_MAX_PACKET_SIZE];
+  WiFiUDP* owners[WIFIUDP_BATCH_SIZE]; // who queued each datagram; nullptr once it has stopped
+  uint8_t tags[WIFIUDP_BATCH_SIZE];
+
+  void dropped(int i)
+  {
+    batchStats.datagramsDropped++;
+    WiFiUDP* owner = this->owners[i];
+    if (owner != nullptr && owner->_dropHandler) {
+      owner->_dropHandler(IPAddress((uint32_t)this->addresses[i].sin_addr.s_addr), ntohs(this->addresses[i].sin_port),
+                          this->data[i], this->iov[i].iov_len, this->tags[i]);
+    }
+  }
+};
+
+static std::vector<WiFiUDP::Socket*> sockets;
+
+static void flushSocket(WiFiUDP::Socket* s)
+{
+  int sent = 0;
+  while (sent < s->queued) {
+    int n = sendmmsg(s->fd, s->messages + sent, s->queued - sent, 0);
+    batchStats.sendCalls++;
+    if (n > 0) {
+      sent += n;
+      batchStats.datagramsSent += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+      // the send buffer is full; drop the rest of the batch like lwIP would
+      for (int i = sent; i < s->queued; i++) {
+        s->dropped(i);
+      }
+      break;
+    }
+    // this datagram can't be sent (unreachable network, ...); skip it and carry on
+    s->dropped(sent++);
+  }
+  s->queued = 0;
+}
+
+WiFiUDP::WiFiUDP()
+{
+  this->_socket = nullptr;
+  this->_txPort = 0;
+  this->_txLength = 0;
+  this->_txOverflow = false;
+  this->_dropTag = 0;
+  this->_rxBuffer = nullptr;
+  this->_rxLength = 0;
+  this->_rxPosition = 0;
+  this->_rxPort = 0;
+}
+
+WiFiUDP::~WiFiUDP()
+{
+  this->stop();
+  delete[] this->_rxBuffer;
+}
+
+uint8_t WiFiUDP::begin(uint16_t port)
+{
+  AsyncLinuxTransportScope transport;
+  this->stop();
+  for (Socket* s : sockets) {
+    if (port != 0 && s->port == port) {
+      s->references++;
+      this->_socket = s;
+      return 1;
+    }
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  int sendBuffer = WIFIUDP_SEND_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return 0;
+  }
+
+  Socket* s = new Socket();
+  s->fd = fd;
+  s->port = port;
+  s->references = 1;
+  s->queued = 0;
+  sockets.push_back(s);
+  this->_socket = s;
+  return 1;
+}
+
+void WiFiUDP::stop()
+{
+  Socket* s = this->_socket;
+  if (s == nullptr) {
+    return;
+  }
+  this->_socket = nullptr;
+  // what we queued still goes out, but drops are no longer ours to hear about
+  for (int i = 0; i < s->queued; i++) {
+    if (s->owners[i] == this) {
+      s->owners[i] = nullptr;
+    }
+  }
+  if (--s->references > 0) {
+    return;
+  }
+  flushSocket(s);
+  ::close(s->fd);
+  for (size_t i = 0; i < sockets.size(); i++) {
+    if (sockets[i] == s) {
+      sockets.erase(sockets.begin() + i);
+      break;
+    }
+  }
+  delete s;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+  if (this->_socket == nullptr && !this->begin(0)) {
+    return 0;
+  }
+  this->_txIP = ip;
+  this->_txPort = port;
+  this->_txLength = 0;
+  this->_txOverflow = false;
+  return 1;
+}
+
+size_t WiFiUDP::write(uint8_t byte)
+{
+  return this->write(&byte, 1);
+}
+
+size_t WiFiUDP::write(const uint8_t* buffer, size_t size)
+{
+  size_t room = WIFIUDP_MAX_PACKET_SIZE - this->_txLength;
+  if (size > room) {
+    this->_txOverflow = true;
+    size = room;
+  }
+  memcpy(this->_txBuffer + this->_txLength, buffer, size);
+  this->_txLength += size;
+  return size;
+}
+
+int WiFiUDP::endPacket()
+{
+  Socket* s = this->_socket;
+  if (s == nullptr || this->_txOverflow) {
+    return 0;
+  }
+  if (s->queued == WIFIUDP_BATCH_SIZE) {
+    flushSocket(s);
+  }
+
+  int i = s->queued++;
+  memcpy(s->data[i], this->_txBuffer, this->_txLength);
+  s->addresses[i] = {};
+  s->addresses[i].sin_family = AF_INET;
+  s->addresses[i].sin_port = htons(this->_txPort);
+  s->addresses[i].sin_addr.s_addr = (uint32_t)this->_txIP;
+  s->iov[i].iov_base = s->data[i];
+  s->iov[i].iov_len = this->_txLength;
+  s->messages[i] = {};
+  s->messages[i].msg_hdr.msg_name = &s->addresses[i];
+  s->messages[i].msg_hdr.msg_namelen = sizeof(s->addresses[i]);
+  s->messages[i].msg_hdr.msg_iov = &s->iov[i];
+  s->messages[i].msg_hdr.msg_iovlen = 1;
+  s->owners[i] = this;
+  s->tags[i] = this->_dropTag;
+  this->_txLength = 0;
+  return 1;
+}
+
+void WiFiUDP::flushAll()
+{
+  for (Socket* s : sockets) {
+    if (s->queued > 0) {
+      flushSocket(s);
+    }
+  }
+}
+
+WiFiUDPBatchStats WiFiUDP::getBatchStats()
+{
+  return batchStats;
+}
+
+void WiFiUDP::onDrop(WiFiUDPDropHandler handler)
+{
+  this->_dropHandler = handler;
+}
+
+void WiFiUDP::setDropTag(uint8_t tag)
+{
+  this->_dropTag = tag;
+}
+
+int WiFiUDP::parsePacket()
+{
+  if (this->_socket == nullptr) {
+    return 0;
+  }
+  if (this->_rxBuffer == nullptr) {
+    AsyncLinuxTransportScope transport;
+    this->_rxBuffer = new uint8_t[WIFIUDP_MAX_PACKET_SIZE];
+  }
+  struct sockaddr_in from = {};
+  socklen_t fromLength = sizeof(from);
+  ssize_t n = recvfrom(this->_socket->fd, this->_rxBuffer, WIFIUDP_MAX_PACKET_SIZE, MSG_DONTWAIT,
+                       (struct sockaddr*)&from, &fromLength);
+  if (n <= 0) {
+    this->_rxLength = 0;
+    this->_rxPosition = 0;
+    return 0;
+  }
+  this->_rxLength = n;
+  this->_rxPosition = 0;
+  this->_rxIP = IPAddress((uint32_t)from.sin_addr.s_addr);
+  this->_rxPort = ntohs(from.sin_port);
+  return n;
+}
+
+int WiFiUDP::available()
+{
+  return this->_rxLength - this->_rxPosition;
+}
+
+int WiFiUDP::read()
+{
+  if (this->_rxPosition >= this->_rxLength) {
+    return -1;
+  }
+  return this->_rxBuffer[this->_rxPosition++];
+}
+
+int WiFiUDP::read(uint8_t* buffer, size_t len)
+{
+  size_t n = min(len, this->_rxLength - this->_rxPosition);
+  if (n > 0) {
+    memcpy(buffer, this->_rxBuffer + this->_rxPosition, n);
+    this->_rxPosition += n;
+  }
+  return n;
+}
+
+IPAddress WiFiUDP::remoteIP()
+{
+  return this->_rxIP;
+}
+
+uint16_t WiFiUDP::remotePort()
+{
+  return this->_rxPort;
+}
@@ -0,0 +1,91 @@
+/**
+ * WiFiUDP for Linux, batching outgoing datagrams into sendmmsg
+ *
+ * Every WiFiUDP begun on the same local port shares one socket, and all
+ * RTSP sessions send through the server's RTP socket, so a fragment sent to
+ * N sessions becomes N entries in a single sendmmsg batch rather than N
+ * sendto calls.
+ * endPacket() only queues; batches go out when full and whenever
+ * asyncLinuxRun() runs.  As with lwIP running out of pbufs, datagrams the
+ * kernel has no room for are dropped and counted, not retried.  Since
+ * their endPacket() has long returned 1 by then, each drop is also handed
+ * to the drop handler of the WiFiUDP that queued it (a Linux extension;
+ * WIFIUDP_HAS_DROP_HANDLER tells code shared with the ESP32 it exists).
+ */
+
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#define WIFIUDP_HAS_DROP_HANDLER 1
+
+#ifndef WIFIUDP_BATCH_SIZE
+#define WIFIUDP_BATCH_SIZE 64 // datagrams per sendmmsg
+#endif
+#ifndef WIFIUDP_MAX_PACKET_SIZE
+#define WIFIUDP_MAX_PACKET_SIZE 2048
+#endif
+
+/**
+ * Process wide send counters
+ */
+struct WiFiUDPBatchStats {
+  uint64_t datagramsSent;
+  uint64_t datagramsDropped;
+  uint64_t sendCalls;        // sendmmsg system calls
+};
+
+/**
+ * A queued datagram the kernel had no room for, with the tag that was
+ * current when it was queued
+ */
+typedef std::function<void (IPAddress ip, uint16_t port, const uint8_t* data, size_t length, uint8_t tag)> WiFiUDPDropHandler;
+
+class WiFiUDP {
+  public:
+    WiFiUDP();
+    ~WiFiUDP();
+    uint8_t begin(uint16_t port);
+    void stop();
+
+    int beginPacket(IPAddress ip, uint16_t port);
+    size_t write(uint8_t byte);
+    size_t write(const uint8_t* buffer, size_t size);
+    int endPacket();
+
+    int parsePacket();
+    int available();
+    int read();
+    int read(uint8_t* buffer, size_t len);
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+    /**
+     * Send every queued datagram on every socket; called by asyncLinuxRun
+     */
+    static void flushAll();
+    static WiFiUDPBatchStats getBatchStats();
+    void onDrop(WiFiUDPDropHandler handler);
+    /**
+     * Attach a tag to the datagrams queued from now on, so the drop
+     * handler can tell them apart
+     */
+    void setDropTag(uint8_t tag);
+
+    struct Socket;
+
+  private:
+    Socket* _socket;
+    IPAddress _txIP;
+    uint16_t _txPort;
+    size_t _txLength;
+    bool _txOverflow;
+    WiFiUDPDropHandler _dropHandler;
+    uint8_t _dropTag;
+    uint8_t _txBuffer[WIFIUDP_MAX_PACKET_SIZE];
+    uint8_t* _rxBuffer; // allocated on the first parsePacket
+    size_t _rxLength;
+    size_t _rxPosition;
+    IPAddress _rxIP;
+    uint16_t _rxPort;
+};
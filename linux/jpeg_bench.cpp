@@ -0,0 +1,79 @@
+/**
+ * How long does it take to index and sign a camera frame?
+ *
+ *   jpeg_bench [iterations=20000] <frame.jpg>...
+ *
+ * Times indexJPEGFrame (everything pushFrame needs to packetize a frame),
+ * decodeJPEGfile, and decodeJPEGfile with a JPEGSceneSignature (scene
+ * suppression) over each frame, and reports the cost per frame.  The header
+ * walk is cheap; the scan for the EOI marker dominates, so expect the time
+ * to grow with the JPEG size rather than its resolution.
+ */
+
+#include "JPEGHelpers.h"
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static volatile uint32_t sink;
+
+template<typename F>
+static double microsPerCall(long iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++) {
+    f();
+  }
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+  int first = 1;
+  long iterations = 20000;
+  if (argc > 1 && strstr(argv[1], ".jpg") == nullptr && strstr(argv[1], ".jpeg") == nullptr) {
+    iterations = atol(argv[1]);
+    first = 2;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: %s [iterations=20000] <frame.jpg>...\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-24s %8s %9s  %10s %10s %10s %9s\n", "frame", "bytes", "size", "index us", "decode us", "signed us", "MB/s");
+  for (int i = first; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    std::vector<unsigned char> jpeg((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    DecodedJPEGFrame frame;
+    if (!indexJPEGFrame(jpeg.data(), jpeg.size(), &frame)) {
+      printf("%-24s %8zu  not a frame the packetizer can send\n", argv[i], jpeg.size());
+      continue;
+    }
+
+    double index = microsPerCall(iterations, [&]() {
+      indexJPEGFrame(jpeg.data(), jpeg.size(), &frame);
+      sink = frame.scanDataLength;
+    });
+    double decode = microsPerCall(iterations, [&]() {
+      BufPtr start = jpeg.data();
+      uint32_t len = jpeg.size();
+      decodeJPEGfile(&start, &len, &frame);
+      sink = len;
+    });
+    JPEGSceneSignature signature;
+    double signedDecode = microsPerCall(iterations, [&]() {
+      BufPtr start = jpeg.data();
+      uint32_t len = jpeg.size();
+      decodeJPEGfile(&start, &len, &frame, &signature);
+      sink = signature.buckets[0];
+    });
+
+    char size[16];
+    snprintf(size, sizeof(size), "%ux%u", frame.width, frame.height);
+    const char* name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+    printf("%-24s %8zu %9s  %10.2f %10.2f %10.2f %9.0f\n",
+      name, jpeg.size(), size, index, decode, signedDecode, jpeg.size() / index);
+  }
+  return 0;
+}
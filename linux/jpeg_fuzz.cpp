@@ -0,0 +1,161 @@
+/**
+ * Fuzz indexJPEGFrame / decodeJPEGfile with damaged camera frames
+ *
+ *   jpeg_fuzz [iterations=200000] <seed.jpg>...
+ *
+ * Each iteration takes one of the seed JPEGs, damages it the way a flaky
+ * camera DMA or a bad relay might (truncation, flipped bytes, stray markers,
+ * bogus segment lengths) and checks that the indexer either rejects it or
+ * returns a descriptor that stays inside the buffer.  The mutated frame gets a
+ * heap buffer of exactly its own size, so build with
+ * -fsanitize=address,undefined to catch any read past the end.
+ *
+ * Built with -DJPEG_FUZZ_LIBFUZZER the same checks become a libFuzzer target
+ * (clang++ -fsanitize=fuzzer,address) and main() is left to libFuzzer.
+ */
+
+#include "JPEGHelpers.h"
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static void check(bool condition, const char* what)
+{
+  if (!condition) {
+    fprintf(stderr, "invariant failed: %s\n", what);
+    abort();
+  }
+}
+
+static bool inside(const unsigned char* p, uint32_t n, const unsigned char* start, uint32_t len)
+{
+  return p >= start && p + n <= start + len;
+}
+
+/**
+ * Index one frame and verify whatever the indexer claims about it;
+ * returns true if the frame was accepted
+ */
+static bool indexAndCheck(const uint8_t* data, size_t size)
+{
+  std::vector<unsigned char> copy(data, data + size);
+  unsigned char* bytes = copy.data();
+  uint32_t len = size;
+
+  DecodedJPEGFrame frame;
+  if (!indexJPEGFrame(bytes, len, &frame)) {
+    return false;
+  }
+  check(frame.jpegData == bytes && frame.jpegLength <= len, "image bounds");
+  check(frame.jpegLength >= 2 && bytes[frame.jpegLength - 2] == 0xff && bytes[frame.jpegLength - 1] == JPEG_EndOfImage, "ends in EOI");
+  check(inside(frame.scanData, frame.scanDataLength, bytes, frame.jpegLength - 2), "scan data bounds");
+  check((frame.type & ~RTP_JPEG_TYPE_RESTART_FLAG) <= RTP_JPEG_TYPE_420, "RFC 2435 type");
+  check(frame.width <= RTP_JPEG_MAX_DIMENSION && frame.height <= RTP_JPEG_MAX_DIMENSION, "RFC 2435 dimensions");
+  check(((frame.type & RTP_JPEG_TYPE_RESTART_FLAG) != 0) == (frame.restartInterval != 0), "restart flag");
+  check((frame.quant0tbl == nullptr) == (frame.quant1tbl == nullptr), "quant tables come in pairs");
+  if (frame.quant0tbl != nullptr) {
+    uint32_t luma = (frame.quantPrecision & 0x01) ? 128 : 64;
+    uint32_t chroma = (frame.quantPrecision & 0x02) ? 128 : 64;
+    check(frame.quantLength == luma + chroma, "quant length");
+    check(inside(frame.quant0tbl, luma, bytes, len) && inside(frame.quant1tbl, chroma, bytes, len), "quant table bounds");
+  }
+  check(frame.segmentCount <= JPEG_MAX_SEGMENTS, "segment count");
+  for (int i = 0; i < frame.segmentCount; i++) {
+    check(frame.segments[i].offset + 2 + frame.segments[i].length <= len, "segment bounds");
+  }
+
+  // decodeJPEGfile wraps the indexer and signs the frame; both must agree
+  BufPtr start = bytes;
+  uint32_t scanLength = len;
+  DecodedJPEGFrame decoded;
+  JPEGSceneSignature signature;
+  check(decodeJPEGfile(&start, &scanLength, &decoded, &signature), "decodeJPEGfile accepts what the indexer accepts");
+  check(start == frame.scanData && scanLength == frame.scanDataLength, "decodeJPEGfile scan data");
+  check(signature.bucketCount >= 1 && signature.bucketCount <= JPEG_SCENE_BUCKETS, "signature buckets");
+  check(compareJPEGSignatures(&signature, &signature) == 0, "a frame repeats itself");
+  return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  indexAndCheck(data, size);
+  return 0;
+}
+
+#ifndef JPEG_FUZZ_LIBFUZZER
+
+static uint32_t rngState = 0x9e3779b9;
+
+static uint32_t rng()
+{
+  // xorshift32; a fixed seed keeps failures reproducible
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static void mutate(std::vector<uint8_t>& frame)
+{
+  int edits = 1 + rng() % 4;
+  for (int e = 0; e < edits && !frame.empty(); e++) {
+    size_t at = rng() % frame.size();
+    switch (rng() % 6) {
+    case 0: // the camera buffer was cut short
+      frame.resize(at);
+      break;
+    case 1:
+      frame[at] ^= 1 << (rng() % 8);
+      break;
+    case 2:
+      frame[at] = rng();
+      break;
+    case 3: // a stray marker
+      frame.insert(frame.begin() + at, {0xff, (uint8_t)(0xc0 + rng() % 64)});
+      break;
+    case 4: // a bogus segment length
+      if (at + 1 < frame.size()) {
+        frame[at] = rng() % 2 ? 0xff : 0x00;
+        frame[at + 1] = rng();
+      }
+      break;
+    case 5: // drop a run of bytes
+      frame.erase(frame.begin() + at, frame.begin() + min(frame.size(), at + 1 + rng() % 64));
+      break;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int first = 1;
+  long iterations = 200000;
+  if (argc > 1 && strstr(argv[1], ".jpg") == nullptr && strstr(argv[1], ".jpeg") == nullptr) {
+    iterations = atol(argv[1]);
+    first = 2;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: %s [iterations=200000] <seed.jpg>...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::vector<uint8_t>> seeds;
+  for (int i = first; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    seeds.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (!indexAndCheck(seeds.back().data(), seeds.back().size())) {
+      fprintf(stderr, "%s: seed is not a frame the packetizer can send\n", argv[i]);
+    }
+  }
+
+  long accepted = 0;
+  for (long i = 0; i < iterations; i++) {
+    std::vector<uint8_t> frame = seeds[rng() % seeds.size()];
+    mutate(frame);
+    accepted += indexAndCheck(frame.data(), frame.size());
+  }
+  printf("%ld mutated frames, %ld accepted, %ld rejected, no faults\n", iterations, accepted, iterations - accepted);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,352 @@
+/**
+ * Does the library stay off the heap once begin() has been called?
+ *
+ *   rtsp_alloc_test <frame.jpg>
+ *
+ * Replaces operator new with a counting hook, calls begin(), and then runs a
+ * few rounds of the whole session life cycle against the server over
+ * loopback: one more viewer than RTSP_MAX_CLIENTS connects (the last one is
+ * refused), the rest go through OPTIONS, DESCRIBE, SETUP and PLAY, receive
+ * frames with FEC, NACK and scene suppression switched on, send a NACK,
+ * PAUSE and PLAY again, TEARDOWN and disconnect, while two HTTP clients take
+ * a snapshot and an MJPEG stream and a third is refused.  The viewers are plain sockets, so the
+ * only code on this thread is the library and the linux/ backend.
+ *
+ * Allocations the backend makes for itself (asyncLinuxTransportDepth: the
+ * AsyncTCP and lwIP share on the ESP32) are reported but not held against
+ * the library; any other allocation after begin() fails the test.  Every
+ * round ends with all connections closed, so the number of live allocations
+ * of either kind must not grow from one round to the next: a connection
+ * object nobody deletes shows up there.
+ */
+
+#include "AsyncRTSP.h"
+#include <arpa/inet.h>
+#include <fstream>
+#include <iterator>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define ALLOC_TEST_RTSP_PORT 8564
+#define ALLOC_TEST_HTTP_PORT 8580
+#define ALLOC_TEST_ROUNDS 3
+#define ALLOC_TEST_VIEWERS (RTSP_MAX_CLIENTS + 1)
+#define ALLOC_TEST_MAX_REPORTED 8
+
+static bool counting = false;
+static long libraryAllocations = 0;
+static long transportAllocations = 0;
+static long liveAllocations = 0;
+static size_t reportedSizes[ALLOC_TEST_MAX_REPORTED];
+
+/**
+ * Sits right in front of every block operator new hands out, so delete
+ * can find the start of the allocation and whether it was counted live
+ */
+struct alignas(16) AllocationHeader {
+  void* base;
+  bool live;
+};
+
+static void countAllocation(size_t size)
+{
+  if (!counting) {
+    return;
+  }
+  if (asyncLinuxTransportDepth > 0) {
+    transportAllocations++;
+    return;
+  }
+  if (libraryAllocations < ALLOC_TEST_MAX_REPORTED) {
+    reportedSizes[libraryAllocations] = size;
+  }
+  libraryAllocations++;
+}
+
+static void* track(void* base, size_t offset, size_t size)
+{
+  if (base == nullptr) {
+    throw std::bad_alloc();
+  }
+  countAllocation(size);
+  AllocationHeader* header = (AllocationHeader*)((uint8_t*)base + offset) - 1;
+  header->base = base;
+  header->live = counting;
+  if (counting) {
+    liveAllocations++;
+  }
+  return header + 1;
+}
+
+// GCC sees malloc'd memory reach free() through these replacements and
+// takes them for a mismatched pair
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size)
+{
+  return track(malloc(sizeof(AllocationHeader) + size), sizeof(AllocationHeader), size);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+  size_t offset = max((size_t)align, sizeof(AllocationHeader));
+  return track(aligned_alloc(offset, (offset + size + offset - 1) / offset * offset), offset, size);
+}
+
+void operator delete(void* p) noexcept
+{
+  if (p == nullptr) {
+    return;
+  }
+  AllocationHeader* header = (AllocationHeader*)p - 1;
+  if (header->live) {
+    liveAllocations--;
+  }
+  free(header->base);
+}
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete(void* p, std::align_val_t) noexcept { operator delete(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { operator delete(p); }
+
+struct Viewer {
+  int tcp;
+  int rtp;
+  int rtcp;
+  uint16_t rtpPort;
+  uint16_t rtcpPort;
+  bool haveSequenceNumber;
+  uint16_t lastSequenceNumber;
+};
+
+static Viewer viewers[ALLOC_TEST_VIEWERS];
+static int snapshotClient = -1;
+static int streamClient = -1;
+static int refusedHTTPClient = -1;
+static uint64_t rtpPackets = 0;
+static uint64_t fecPackets = 0;
+static uint64_t httpBytes = 0;
+static uint8_t scratch[65536];
+
+static AsyncRTSPServer* server;
+static AsyncMJPEGServer* http;
+static long logLines = 0;
+
+static int connectTo(uint16_t port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  return fd;
+}
+
+static int bindUDP(uint16_t* port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  getsockname(fd, (struct sockaddr*)&addr, &len);
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+static void sendText(int fd, const char* text)
+{
+  send(fd, text, strlen(text), MSG_NOSIGNAL);
+}
+
+static void drainTCP(int fd, uint64_t* bytes)
+{
+  ssize_t n;
+  while (fd >= 0 && (n = recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0) {
+    if (bytes != nullptr) {
+      *bytes += n;
+    }
+  }
+}
+
+static void drainViewers()
+{
+  for (int i = 0; i < ALLOC_TEST_VIEWERS; i++) {
+    Viewer& v = viewers[i];
+    drainTCP(v.tcp, nullptr);
+    ssize_t n;
+    while (v.rtp >= 0 && (n = recv(v.rtp, scratch, sizeof(scratch), MSG_DONTWAIT)) >= 12) {
+      if ((scratch[1] & 0x7f) == RTP_FEC_PAYLOAD_TYPE) {
+        fecPackets++;
+        continue;
+      }
+      rtpPackets++;
+      v.haveSequenceNumber = true;
+      v.lastSequenceNumber = (scratch[2] << 8) | scratch[3];
+    }
+  }
+  drainTCP(snapshotClient, &httpBytes);
+  drainTCP(streamClient, &httpBytes);
+}
+
+/**
+ * Run the server loop for ms milliseconds, pushing a frame every
+ * frameInterval ms when it is nonzero
+ */
+static void pump(uint32_t ms, uint32_t frameInterval, std::vector<uint8_t>& jpeg, std::shared_ptr<void>& image)
+{
+  uint32_t start = millis();
+  uint32_t lastFrame = 0;
+  while (millis() - start < ms) {
+    if (frameInterval != 0 && millis() - lastFrame >= frameInterval) {
+      lastFrame = millis();
+      server->pushFrame(jpeg.data(), jpeg.size(), image);
+    }
+    asyncLinuxRun(server->isSendingFrame() ? 0 : 1);
+    server->tick();
+    server->processLog();
+    drainViewers();
+  }
+}
+
+/**
+ * RTCP generic NACK (RFC 4585 section 6.2.1) for the viewer's last packet
+ */
+static void sendNACK(Viewer& v)
+{
+  uint8_t nack[16] = {0x81, 205, 0, 3};
+  nack[12] = v.lastSequenceNumber >> 8;
+  nack[13] = v.lastSequenceNumber & 0xff;
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(RTSP_RTCP_SERVER_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sendto(v.rtcp, nack, sizeof(nack), 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <frame.jpg>\n", argv[0]);
+    return 1;
+  }
+  std::ifstream file(argv[1], std::ios::binary);
+  std::vector<uint8_t> jpeg((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::shared_ptr<void> image(jpeg.data(), [](void*) {});
+  char request[512];
+
+  server = new AsyncRTSPServer(ALLOC_TEST_RTSP_PORT, dimensions{0, 0});
+  http = new AsyncMJPEGServer(ALLOC_TEST_HTTP_PORT);
+  server->onClient([](void*) {}, nullptr);
+  server->onFrameFinished([]() {}, nullptr);
+  server->setLogFunction([](uint8_t, const char*) { logLines++; }, nullptr);
+  server->setHTTPServer(http);
+  server->setFECGroupSize(4);
+  server->setNACKEnabled(true);
+  server->setSceneSuppression(300);
+  server->begin();
+  http->begin();
+
+  counting = true;
+  uint32_t nacksServed = 0;
+  long liveAfterFirstRound = 0;
+  for (int round = 0; round < ALLOC_TEST_ROUNDS; round++) {
+    for (int i = 0; i < ALLOC_TEST_VIEWERS; i++) {
+      Viewer& v = viewers[i];
+      v.tcp = connectTo(ALLOC_TEST_RTSP_PORT);
+      v.rtp = bindUDP(&v.rtpPort);
+      v.rtcp = bindUDP(&v.rtcpPort);
+      v.haveSequenceNumber = false;
+    }
+    snapshotClient = connectTo(ALLOC_TEST_HTTP_PORT);
+    streamClient = connectTo(ALLOC_TEST_HTTP_PORT);
+    refusedHTTPClient = connectTo(ALLOC_TEST_HTTP_PORT);
+    pump(100, 0, jpeg, image);
+
+    for (int i = 0; i < ALLOC_TEST_VIEWERS; i++) {
+      Viewer& v = viewers[i];
+      // the FEC stream is set up on the RTP port too; the payload type tells them apart
+      snprintf(request, sizeof(request),
+        "OPTIONS rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 1\r\n\r\n"
+        "DESCRIBE rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 2\r\nAccept: application/sdp\r\n\r\n"
+        "SETUP rtsp://127.0.0.1/video RTSP/1.0\r\nCSeq: 3\r\nTransport: RTP/AVPF;unicast;client_port=%u-%u\r\n\r\n"
+        "SETUP rtsp://127.0.0.1/fec RTSP/1.0\r\nCSeq: 4\r\nTransport: RTP/AVP;unicast;client_port=%u-%u\r\n\r\n"
+        "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 5\r\n\r\n",
+        v.rtpPort, v.rtcpPort, v.rtpPort, v.rtcpPort);
+      sendText(v.tcp, request);
+    }
+    sendText(snapshotClient, "GET /snapshot.jpg HTTP/1.1\r\n\r\n");
+    sendText(streamClient, "GET /stream HTTP/1.1\r\n\r\n");
+    pump(1000, 66, jpeg, image);
+
+    for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+      if (viewers[i].haveSequenceNumber) {
+        sendNACK(viewers[i]);
+      }
+    }
+    sendText(viewers[0].tcp, "PAUSE rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 6\r\n\r\n");
+    pump(200, 66, jpeg, image);
+    sendText(viewers[0].tcp, "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 7\r\n\r\n");
+    pump(500, 66, jpeg, image);
+
+    RTSPClientStats stats;
+    for (int slot = 0; slot < RTSP_MAX_CLIENTS; slot++) {
+      if (server->getClientStats(slot, &stats)) {
+        nacksServed += stats.nacksServed;
+      }
+    }
+    for (int i = 0; i < ALLOC_TEST_VIEWERS; i++) {
+      sendText(viewers[i].tcp, "TEARDOWN rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 8\r\n\r\n");
+    }
+    pump(100, 0, jpeg, image);
+    for (int i = 0; i < ALLOC_TEST_VIEWERS; i++) {
+      close(viewers[i].tcp);
+      close(viewers[i].rtp);
+      close(viewers[i].rtcp);
+      viewers[i].tcp = viewers[i].rtp = viewers[i].rtcp = -1;
+    }
+    close(snapshotClient);
+    close(streamClient);
+    close(refusedHTTPClient);
+    snapshotClient = streamClient = refusedHTTPClient = -1;
+    pump(200, 0, jpeg, image);
+    if (round == 0) {
+      liveAfterFirstRound = liveAllocations;
+    }
+  }
+  counting = false;
+
+  RTSPServerStats serverStats = server->getServerStats();
+  MJPEGServerStats httpStats = http->getStats();
+  printf("%d rounds of %d RTSP viewers and 3 HTTP clients\n", ALLOC_TEST_ROUNDS, ALLOC_TEST_VIEWERS);
+  printf("  %u frames sent, %u suppressed; %llu RTP and %llu FEC packets received, %u NACKs served\n",
+    serverStats.framesSent, serverStats.framesSuppressed,
+    (unsigned long long)rtpPackets, (unsigned long long)fecPackets, nacksServed);
+  printf("  %u HTTP frames served, %llu HTTP bytes received; %ld log lines\n",
+    httpStats.framesServed, (unsigned long long)httpBytes, logLines);
+  printf("  allocations after begin(): %ld by the library, %ld by the transport\n", libraryAllocations, transportAllocations);
+  printf("  live allocations after round 1: %ld, after round %d: %ld\n", liveAfterFirstRound, ALLOC_TEST_ROUNDS, liveAllocations);
+  for (int i = 0; i < min(libraryAllocations, (long)ALLOC_TEST_MAX_REPORTED); i++) {
+    printf("    library allocation of %zu bytes\n", reportedSizes[i]);
+  }
+
+  bool exercised = serverStats.framesSent > 0 && serverStats.framesSuppressed > 0 && rtpPackets > 0
+    && fecPackets > 0 && nacksServed > 0 && httpStats.framesServed > 0;
+  if (!exercised) {
+    printf("FAIL: not every path was exercised\n");
+    return 1;
+  }
+  if (libraryAllocations > 0) {
+    printf("FAIL: the library allocated after begin()\n");
+    return 1;
+  }
+  if (liveAllocations > liveAfterFirstRound) {
+    printf("FAIL: %ld allocations leaked after the first round\n", liveAllocations - liveAfterFirstRound);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
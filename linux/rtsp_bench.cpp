@@ -0,0 +1,199 @@
+/**
+ * How many PLAYing RTSP sessions can one core feed?
+ *
+ *   rtsp_bench <frame.jpg> [fps=15] [seconds-per-step=5] [max-clients=1024]
+ *
+ * Serves the given JPEG (e.g. a 1280x720 frame saved from the camera) in pull
+ * mode at the given rate and doubles the number of loopback viewers each step.
+ * The server and the viewers' RTSP control connections run on this thread;
+ * a second thread drains the viewers' RTP sockets.  A step is sustained if
+ * the server keeps the frame rate, stays under 95% of its core, and the
+ * viewers receive at least 99% of the packets.  On loopback the kernel's
+ * receive work is partly charged to the sending thread, so the numbers are
+ * a lower bound for a real NIC.
+ */
+
+#include "AsyncRTSP.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_RTSP_PORT 8554
+
+static std::atomic<uint64_t> packetsReceived(0);
+static std::atomic<bool> running(true);
+static int receiverEpoll;
+
+static double threadCPUSeconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void drainReceivers()
+{
+  const int batch = 64;
+  static uint8_t buffers[batch][2048];
+  struct mmsghdr messages[batch];
+  struct iovec iov[batch];
+  for (int i = 0; i < batch; i++) {
+    iov[i] = {buffers[i], sizeof(buffers[i])};
+    messages[i] = {};
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  struct epoll_event events[64];
+  while (running) {
+    int n = epoll_wait(receiverEpoll, events, 64, 10);
+    for (int i = 0; i < n; i++) {
+      int got;
+      while ((got = recvmmsg(events[i].data.fd, messages, batch, MSG_DONTWAIT, nullptr)) > 0) {
+        packetsReceived += got;
+      }
+    }
+  }
+}
+
+/**
+ * A viewer: an RTP socket for the server to send to, and an RTSP control
+ * connection that SETUPs and PLAYs
+ */
+static bool addViewer(int cseq)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  int receiveBuffer = 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(receiverEpoll, EPOLL_CTL_ADD, fd, &ev);
+
+  uint16_t rtpPort = ntohs(addr.sin_port);
+  AsyncClient* control = new AsyncClient();
+  control->onConnect([rtpPort, cseq](void*, AsyncClient* c) {
+    char request[256];
+    snprintf(request, sizeof(request),
+      "SETUP rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: %d\r\nTransport: RTP/AVP;unicast;client_port=%u-%u\r\n\r\n"
+      "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: %d\r\n\r\n",
+      cseq, rtpPort, rtpPort + 1, cseq + 1);
+    c->write(request);
+  });
+  control->onDisconnect([](void*, AsyncClient* c) { delete c; });
+  return control->connect(IPAddress(127, 0, 0, 1), BENCH_RTSP_PORT);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <frame.jpg> [fps=15] [seconds-per-step=5] [max-clients=%d]\n", argv[0], RTSP_MAX_CLIENTS);
+    return 1;
+  }
+  std::ifstream file(argv[1], std::ios::binary);
+  auto jpeg = std::make_shared<std::vector<uint8_t>>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  int fps = argc > 2 ? atoi(argv[2]) : 15;
+  int seconds = argc > 3 ? atoi(argv[3]) : 5;
+  int maxClients = min(argc > 4 ? atoi(argv[4]) : RTSP_MAX_CLIENTS, RTSP_MAX_CLIENTS);
+
+  // two TCP ends and one RTP socket per viewer
+  struct rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+
+  AsyncRTSPServer* server = new AsyncRTSPServer(BENCH_RTSP_PORT, dimensions{0, 0});
+  server->onClient([](void*) {}, nullptr);
+  server->onFrameFinished([]() {}, nullptr);
+  server->setLogFunction([](uint8_t, const char*) {}, nullptr);
+  server->setMaxFrameRate(fps);
+  server->setFrameSource([server, jpeg]() {
+    // the "camera": hand over the same frame every time
+    server->pushFrame(jpeg->data(), jpeg->size(), jpeg);
+  }, nullptr);
+  server->begin();
+
+  receiverEpoll = epoll_create1(0);
+  std::thread receiver(drainReceivers);
+
+  printf("%zu byte frame at %d fps, %d s per step\n", jpeg->size(), fps, seconds);
+  printf("clients   fps    core   packets/s  sendmmsg/s  delivered  sustained\n");
+  int viewers = 0;
+  for (int step = 1; step <= maxClients; step *= 2) {
+    while (viewers < step) {
+      if (!addViewer(2 * viewers + 1)) {
+        fprintf(stderr, "could not add viewer %d\n", viewers + 1);
+        running = false;
+        receiver.join();
+        return 1;
+      }
+      viewers++;
+    }
+    // let the new viewers connect and PLAY
+    uint32_t settle = millis();
+    while (millis() - settle < 1000) {
+      asyncLinuxRun(server->isSendingFrame() ? 0 : 1);
+      server->tick();
+      server->processLog();
+    }
+
+    usleep(100000); // and the receiver drain what was sent while they did
+    RTSPServerStats before = server->getServerStats();
+    WiFiUDPBatchStats udpBefore = WiFiUDP::getBatchStats();
+    uint64_t receivedBefore = packetsReceived;
+    uint64_t sentBefore = 0;
+    RTSPClientStats cs;
+    for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+      if (server->getClientStats(i, &cs)) {
+        sentBefore += cs.packetsSent;
+      }
+    }
+    double cpuBefore = threadCPUSeconds();
+    uint32_t start = millis();
+    while (millis() - start < (uint32_t)seconds * 1000) {
+      asyncLinuxRun(server->isSendingFrame() ? 0 : 1);
+      server->tick();
+      server->processLog();
+    }
+    double elapsed = (millis() - start) / 1000.0;
+    double cpu = (threadCPUSeconds() - cpuBefore) / elapsed;
+    usleep(100000); // let the receiver catch up with the last frame
+    RTSPServerStats after = server->getServerStats();
+    WiFiUDPBatchStats udpAfter = WiFiUDP::getBatchStats();
+    uint64_t sentAfter = 0;
+    for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+      if (server->getClientStats(i, &cs)) {
+        sentAfter += cs.packetsSent;
+      }
+    }
+    double achievedFps = (after.framesSent - before.framesSent) / elapsed;
+    double delivered = sentAfter > sentBefore ? (double)(packetsReceived - receivedBefore) / (sentAfter - sentBefore) : 0;
+    bool sustained = achievedFps >= 0.95 * fps && cpu < 0.95 && delivered >= 0.99;
+    printf("%7d  %5.1f  %5.1f%%  %10.0f  %10.0f  %8.2f%%  %s\n",
+      viewers, achievedFps, cpu * 100,
+      (udpAfter.datagramsSent - udpBefore.datagramsSent) / elapsed,
+      (udpAfter.sendCalls - udpBefore.sendCalls) / elapsed,
+      delivered * 100, sustained ? "yes" : "no");
+    fflush(stdout);
+    if (!sustained) {
+      break;
+    }
+  }
+  running = false;
+  receiver.join();
+  return 0;
+}
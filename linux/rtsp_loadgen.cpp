@@ -0,0 +1,457 @@
+/**
+ * What do viewers on lossy, narrow links actually get?
+ *
+ *   rtsp_loadgen <frames.mjpeg|jpeg-dir> [fps=15] [clients=4] [seconds=10] [loss%=0] [kbit/s=0]
+ *
+ * Replays a recorded camera stream (a file of concatenated JPEGs, as written
+ * by ffmpeg -f mjpeg, or a directory of .jpg files in name order) into
+ * pushFrame at the given rate, looping, and puts the given number of
+ * loopback viewers through OPTIONS, DESCRIBE, SETUP and PLAY.  Each viewer
+ * sees the stream through an emulated link: packets are dropped at random
+ * with the given loss rate, and a kbit/s limit (0 = unlimited) serializes
+ * them through a 64 KiB queue that drops when full.  Loss and kbit/s take a
+ * comma separated list that is handed out round robin, so 0,2,10 gives every
+ * third viewer 10% loss.
+ *
+ * Per viewer it reports goodput (scan bytes of frames that arrived whole),
+ * the ratio of complete frames to frames sent, and RFC 3550 interarrival
+ * jitter measured after the link; for the server, its CPU per frame.  The
+ * server and the viewers' control connections run on this thread, a second
+ * thread receives and scores the RTP packets.
+ */
+
+#include "AsyncRTSP.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cmath>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define LOADGEN_RTSP_PORT 8574
+#ifndef LOADGEN_QUEUE_BYTES
+#define LOADGEN_QUEUE_BYTES (64 * 1024) // the emulated link's buffer; a frame larger than this never gets through a limited link whole
+#endif
+#define LOADGEN_MAX_REPORTED 16
+
+struct Frame {
+  uint8_t* data;
+  size_t length;
+  std::shared_ptr<void> owner;
+};
+
+/**
+ * One viewer: its link emulation and what made it across.  Written by the
+ * receiver thread only; main reads it after joining.
+ */
+struct Viewer {
+  int rtp;
+  uint16_t rtpPort;
+  double lossPercent;
+  uint32_t kbps;
+  double linkFreeMicros;      // when the emulated link finishes its queue
+  uint64_t packetsReceived;
+  uint64_t packetsLost;       // dropped by the emulated loss
+  uint64_t packetsQueueDropped;
+  uint64_t goodputBytes;
+  uint32_t framesComplete;
+  uint32_t framesIncomplete;
+  // the frame being reassembled
+  bool haveFrame;
+  uint32_t frameTimestamp;
+  uint32_t nextOffset;
+  uint32_t frameBytes;
+  bool frameBroken;
+  // RFC 3550 section 6.4.1, in 90 kHz units
+  bool haveTransit;
+  double transit;
+  double jitter;
+};
+
+static std::vector<Viewer> viewers;
+static std::atomic<bool> running(true);
+static std::atomic<bool> measuring(false);
+static int receiverEpoll;
+static uint32_t rngState = 0x9e3779b9;
+
+static double threadCPUSeconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double nowMicros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static uint32_t rng()
+{
+  // xorshift32; only the receiver thread draws from it
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static void finishFrame(Viewer* v)
+{
+  if (v->haveFrame && measuring) {
+    v->framesIncomplete++;
+  }
+  v->haveFrame = false;
+}
+
+/**
+ * Score one RTP/JPEG packet (RFC 2435) that made it across the link at
+ * arrivalMicros
+ */
+static void receivePacket(Viewer* v, const uint8_t* p, size_t len, double arrivalMicros)
+{
+  if (len < 20 || (p[1] & 0x7f) != 26) {
+    return; // FEC parity, or not RTP/JPEG
+  }
+  bool marker = p[1] & 0x80;
+  uint32_t timestamp = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+  uint32_t offset = (p[13] << 16) | (p[14] << 8) | p[15];
+  uint8_t type = p[16];
+  uint8_t q = p[17];
+  size_t header = 20;
+  if (type >= 64) {
+    header += 4; // restart marker header
+  }
+  if (q >= 128 && offset == 0) {
+    if (len < header + 4) {
+      return;
+    }
+    header += 4 + ((p[header + 2] << 8) | p[header + 3]); // quantization table header
+  }
+  if (len < header) {
+    return;
+  }
+  uint32_t data = len - header;
+
+  if (measuring) {
+    v->packetsReceived++;
+    double t = arrivalMicros * 0.09 - timestamp;
+    if (v->haveTransit) {
+      double d = fabs(t - v->transit);
+      v->jitter += (d - v->jitter) / 16;
+    }
+    v->transit = t;
+    v->haveTransit = true;
+  }
+
+  if (!v->haveFrame || v->frameTimestamp != timestamp) {
+    finishFrame(v);
+    v->haveFrame = true;
+    v->frameTimestamp = timestamp;
+    v->nextOffset = 0;
+    v->frameBytes = 0;
+    v->frameBroken = false;
+  }
+  if (offset != v->nextOffset) {
+    v->frameBroken = true;
+  }
+  v->nextOffset = offset + data;
+  v->frameBytes += data;
+  if (marker) {
+    if (measuring) {
+      if (v->frameBroken) {
+        v->framesIncomplete++;
+      } else {
+        v->framesComplete++;
+        v->goodputBytes += v->frameBytes;
+      }
+    }
+    v->haveFrame = false;
+  }
+}
+
+/**
+ * Put a packet through the viewer's emulated link: random loss, then a
+ * rate limited queue; returns the time it leaves the link, or a negative
+ * value if it was dropped
+ */
+static double emulateLink(Viewer* v, size_t len, double nowUs)
+{
+  if (v->lossPercent > 0 && rng() % 10000 < v->lossPercent * 100) {
+    if (measuring) {
+      v->packetsLost++;
+    }
+    return -1;
+  }
+  if (v->kbps == 0) {
+    return nowUs;
+  }
+  double start = max(nowUs, v->linkFreeMicros);
+  if ((start - nowUs) * v->kbps / 8000 > LOADGEN_QUEUE_BYTES) {
+    if (measuring) {
+      v->packetsQueueDropped++;
+    }
+    return -1;
+  }
+  v->linkFreeMicros = start + len * 8000.0 / v->kbps;
+  return v->linkFreeMicros;
+}
+
+static void receiveAll()
+{
+  const int batch = 64;
+  static uint8_t buffers[batch][2048];
+  struct mmsghdr messages[batch];
+  struct iovec iov[batch];
+  for (int i = 0; i < batch; i++) {
+    iov[i] = {buffers[i], sizeof(buffers[i])};
+    messages[i] = {};
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  struct epoll_event events[64];
+  while (running) {
+    int n = epoll_wait(receiverEpoll, events, 64, 10);
+    for (int i = 0; i < n; i++) {
+      Viewer* v = &viewers[events[i].data.u32];
+      int got;
+      while ((got = recvmmsg(v->rtp, messages, batch, MSG_DONTWAIT, nullptr)) > 0) {
+        double now = nowMicros();
+        for (int m = 0; m < got; m++) {
+          double arrival = emulateLink(v, messages[m].msg_len, now);
+          if (arrival >= 0) {
+            receivePacket(v, buffers[m], messages[m].msg_len, arrival);
+          }
+        }
+      }
+    }
+  }
+}
+
+static bool openViewer(Viewer* v, uint32_t index)
+{
+  v->rtp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  int receiveBuffer = 1024 * 1024;
+  setsockopt(v->rtp, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (v->rtp < 0 || bind(v->rtp, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(v->rtp, (struct sockaddr*)&addr, &len) < 0) {
+    return false;
+  }
+  v->rtpPort = ntohs(addr.sin_port);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u32 = index;
+  epoll_ctl(receiverEpoll, EPOLL_CTL_ADD, v->rtp, &ev);
+
+  uint16_t rtpPort = v->rtpPort;
+  AsyncClient* control = new AsyncClient();
+  control->onConnect([rtpPort](void*, AsyncClient* c) {
+    char request[512];
+    snprintf(request, sizeof(request),
+      "OPTIONS rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 1\r\n\r\n"
+      "DESCRIBE rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 2\r\nAccept: application/sdp\r\n\r\n"
+      "SETUP rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 3\r\nTransport: RTP/AVP;unicast;client_port=%u-%u\r\n\r\n"
+      "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 4\r\n\r\n",
+      rtpPort, rtpPort + 1);
+    c->write(request);
+  });
+  control->onDisconnect([](void*, AsyncClient* c) { delete c; });
+  return control->connect(IPAddress(127, 0, 0, 1), LOADGEN_RTSP_PORT);
+}
+
+static void loadMJPEG(const char* path, std::vector<Frame>* frames)
+{
+  std::ifstream file(path, std::ios::binary);
+  auto bytes = std::make_shared<std::vector<uint8_t>>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  size_t at = 0;
+  while (at + 4 <= bytes->size()) {
+    uint8_t* p = bytes->data() + at;
+    DecodedJPEGFrame frame;
+    if (p[0] == 0xff && p[1] == 0xd8 && indexJPEGFrame(p, bytes->size() - at, &frame)) {
+      frames->push_back({p, frame.jpegLength, bytes});
+      at += frame.jpegLength;
+    } else {
+      at++;
+    }
+  }
+}
+
+static void loadDirectory(const char* path, std::vector<Frame>* frames)
+{
+  std::vector<std::string> names;
+  DIR* dir = opendir(path);
+  while (struct dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos && (name.substr(dot) == ".jpg" || name.substr(dot) == ".jpeg")) {
+      names.push_back(std::string(path) + "/" + name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  for (const std::string& name : names) {
+    std::ifstream file(name, std::ios::binary);
+    auto jpeg = std::make_shared<std::vector<uint8_t>>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    DecodedJPEGFrame frame;
+    if (indexJPEGFrame(jpeg->data(), jpeg->size(), &frame)) {
+      frames->push_back({jpeg->data(), jpeg->size(), jpeg});
+    } else {
+      fprintf(stderr, "%s: not a frame the packetizer can send\n", name.c_str());
+    }
+  }
+}
+
+static std::vector<double> parseList(const char* list)
+{
+  std::vector<double> values;
+  for (const char* p = list; *p; p++) {
+    values.push_back(atof(p));
+    p = strchr(p, ',');
+    if (p == nullptr) {
+      break;
+    }
+  }
+  return values.empty() ? std::vector<double>{0} : values;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <frames.mjpeg|jpeg-dir> [fps=15] [clients=4] [seconds=10] [loss%%=0] [kbit/s=0]\n", argv[0]);
+    return 1;
+  }
+  std::vector<Frame> frames;
+  DIR* dir = opendir(argv[1]);
+  if (dir != nullptr) {
+    closedir(dir);
+    loadDirectory(argv[1], &frames);
+  } else {
+    loadMJPEG(argv[1], &frames);
+  }
+  if (frames.empty()) {
+    fprintf(stderr, "%s: no frames the packetizer can send\n", argv[1]);
+    return 1;
+  }
+  int fps = argc > 2 ? max(atoi(argv[2]), 1) : 15;
+  int clients = argc > 3 ? atoi(argv[3]) : 4;
+  if (clients > RTSP_MAX_CLIENTS) {
+    fprintf(stderr, "only %d viewers; build with -DRTSP_MAX_CLIENTS=%d for more\n", RTSP_MAX_CLIENTS, clients);
+    clients = RTSP_MAX_CLIENTS;
+  }
+  int seconds = argc > 4 ? atoi(argv[4]) : 10;
+  std::vector<double> loss = parseList(argc > 5 ? argv[5] : "0");
+  std::vector<double> kbps = parseList(argc > 6 ? argv[6] : "0");
+
+  // one TCP end and one RTP socket per viewer, plus the server's ends
+  struct rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+
+  AsyncRTSPServer* server = new AsyncRTSPServer(LOADGEN_RTSP_PORT, dimensions{0, 0});
+  server->onClient([](void*) {}, nullptr);
+  server->onFrameFinished([]() {}, nullptr);
+  server->setLogFunction([](uint8_t, const char*) {}, nullptr);
+  server->begin();
+
+  receiverEpoll = epoll_create1(0);
+  viewers.resize(clients);
+  for (int i = 0; i < clients; i++) {
+    viewers[i] = {};
+    viewers[i].lossPercent = loss[i % loss.size()];
+    viewers[i].kbps = kbps[i % kbps.size()];
+    if (!openViewer(&viewers[i], i)) {
+      fprintf(stderr, "could not add viewer %d\n", i + 1);
+      return 1;
+    }
+  }
+  std::thread receiver(receiveAll);
+
+  // replay the recording, looping, at a fixed rate
+  size_t next = 0;
+  uint32_t frameMicros = 1000000 / fps;
+  uint32_t lastPush = micros() - frameMicros;
+  auto run = [&](uint32_t millisToRun) {
+    uint32_t start = millis();
+    while (millis() - start < millisToRun) {
+      if (micros() - lastPush >= frameMicros) {
+        lastPush += frameMicros;
+        const Frame& f = frames[next++ % frames.size()];
+        server->pushFrame(f.data, f.length, f.owner);
+      }
+      asyncLinuxRun(server->isSendingFrame() ? 0 : 1);
+      server->tick();
+      server->processLog();
+    }
+  };
+
+  run(1000); // let the viewers connect and PLAY
+  RTSPServerStats before = server->getServerStats();
+  double cpuBefore = threadCPUSeconds();
+  uint32_t start = millis();
+  measuring = true;
+  run(seconds * 1000);
+  measuring = false;
+  double elapsed = (millis() - start) / 1000.0;
+  double cpu = threadCPUSeconds() - cpuBefore;
+  RTSPServerStats after = server->getServerStats();
+  usleep(100000);
+  running = false;
+  receiver.join();
+
+  uint32_t framesSent = after.framesSent - before.framesSent;
+  printf("%zu frames replayed at %d fps to %d viewers for %.1f s; %u frames sent, %u replaced before they were sent\n",
+    frames.size(), fps, clients, elapsed, framesSent, after.framesReplaced - before.framesReplaced);
+  printf("server thread: %.0f us CPU per frame, event loop included (%.0f%% of a core); packetizing %llu us, sending %llu us per frame\n",
+    framesSent ? cpu * 1e6 / framesSent : 0, cpu / elapsed * 100,
+    (unsigned long long)(framesSent ? (after.prepMicros - before.prepMicros) / framesSent : 0),
+    (unsigned long long)(framesSent ? (after.sendMicros - before.sendMicros) / framesSent : 0));
+  // what the server itself noticed; the emulated links are invisible to it, kernel drops are not
+  uint64_t packetsFailed = 0;
+  uint64_t framesIncomplete = 0;
+  RTSPClientStats cs;
+  for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+    if (server->getClientStats(i, &cs)) {
+      packetsFailed += cs.packetsFailed;
+      framesIncomplete += cs.framesIncomplete;
+    }
+  }
+  printf("server sessions since PLAY: %llu fragments failed, %llu frames incomplete; %llu datagrams dropped by the kernel\n",
+    (unsigned long long)packetsFailed, (unsigned long long)framesIncomplete,
+    (unsigned long long)WiFiUDP::getBatchStats().datagramsDropped);
+  printf("viewer  loss%%  kbit/s   packets   lost  queued-out  goodput kbit/s  complete   jitter ms\n");
+  double totalGoodput = 0;
+  double totalComplete = 0;
+  double totalJitter = 0;
+  for (int i = 0; i < clients; i++) {
+    const Viewer& v = viewers[i];
+    double goodput = v.goodputBytes * 8 / elapsed / 1000;
+    double complete = framesSent ? (double)v.framesComplete / framesSent : 0;
+    double jitter = v.jitter / 90;
+    totalGoodput += goodput;
+    totalComplete += complete;
+    totalJitter += jitter;
+    if (i < LOADGEN_MAX_REPORTED) {
+      printf("%6d  %5.1f  %6u  %8llu  %5llu  %10llu  %14.0f  %7.1f%%  %10.2f\n",
+        i + 1, v.lossPercent, v.kbps, (unsigned long long)v.packetsReceived,
+        (unsigned long long)v.packetsLost, (unsigned long long)v.packetsQueueDropped,
+        goodput, complete * 100, jitter);
+    }
+  }
+  printf("   all                                        %14.0f  %7.1f%%  %10.2f  (goodput summed; ratio, jitter averaged)\n",
+    totalGoodput, totalComplete / clients * 100, totalJitter / clients);
+  return 0;
+}
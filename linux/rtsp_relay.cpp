@@ -0,0 +1,50 @@
+/**
+ * Re-serve an ESP32 camera's HTTP MJPEG stream over RTSP to many viewers
+ *
+ *   rtsp_relay <camera-ip> [camera-port=80] [path=/stream] [rtsp-port=554]
+ *
+ * Viewers connect to rtsp://<gateway>:<rtsp-port>/
+ */
+
+#include "AsyncRTSP.h"
+#include "MJPEGRelay.h"
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <camera-ip> [camera-port=80] [path=/stream] [rtsp-port=554]\n", argv[0]);
+    return 1;
+  }
+  IPAddress camera;
+  if (!camera.fromString(argv[1])) {
+    fprintf(stderr, "not an IPv4 address: %s\n", argv[1]);
+    return 1;
+  }
+  uint16_t cameraPort = argc > 2 ? atoi(argv[2]) : 80;
+  const char* path = argc > 3 ? argv[3] : "/stream";
+  uint16_t rtspPort = argc > 4 ? atoi(argv[4]) : 554;
+
+  // the client pool and packet buffers live inside the server, so keep it off the stack
+  AsyncRTSPServer* server = new AsyncRTSPServer(rtspPort, dimensions{0, 0});
+  server->onClient([](void*) {}, nullptr);
+  server->onFrameFinished([]() {}, nullptr);
+  server->setLogFunction([](uint8_t, const char* line) { fprintf(stderr, "%s\n", line); }, nullptr);
+  server->begin();
+
+  MJPEGRelay relay(server, camera, cameraPort, path);
+  uint32_t lastReport = millis();
+  while (true) {
+    relay.handle();
+    asyncLinuxRun(server->isSendingFrame() ? 0 : 1);
+    server->tick();
+    server->processLog();
+    if (millis() - lastReport >= 10000) {
+      lastReport = millis();
+      MJPEGRelayStats rs = relay.getStats();
+      WiFiUDPBatchStats us = WiFiUDP::getBatchStats();
+      fprintf(stderr, "relayed %u frames (%u dropped, %u connects); %llu datagrams in %llu sendmmsg calls, %llu dropped\n",
+        rs.framesRelayed, rs.framesDropped, rs.connects,
+        (unsigned long long)us.datagramsSent, (unsigned long long)us.sendCalls, (unsigned long long)us.datagramsDropped);
+    }
+  }
+}
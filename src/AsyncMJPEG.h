@@ -0,0 +1,132 @@
+/**
+ * HTTP snapshot and MJPEG endpoint fed from the same frames as the RTSP server
+ *
+ *   GET /snapshot.jpg  the next frame as a single image/jpeg response
+ *   GET /stream        multipart/x-mixed-replace stream of frames
+ *
+ * Frames are never copied: the JPEG bytes are handed to lwIP by reference
+ * (AsyncClient::add without ASYNC_WRITE_FLAG_COPY) and each consumer holds
+ * the frame's shared_ptr until every byte of it has been ACKed.  A consumer
+ * that is still sending when new frames arrive simply skips them and picks
+ * up the latest frame once it is done, the same way slow RTSP clients lose
+ * frames rather than queueing them.
+ */
+
+#pragma once
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <memory>
+
+#ifndef RTSP_MAX_HTTP_CLIENTS
+#define RTSP_MAX_HTTP_CLIENTS 2 // concurrent snapshot/stream consumers; further connections are refused
+#endif
+#define HTTP_MAX_REQUEST_SIZE 512 // only the request line matters; the rest is discarded
+#define HTTP_MAX_HEADER_SIZE 160
+#define HTTP_MJPEG_BOUNDARY "rtspserverframe"
+
+class AsyncMJPEGServer;
+
+/**
+ * Server wide HTTP counters
+ */
+struct MJPEGServerStats {
+  uint32_t framesServed;
+  uint32_t framesSkipped; // frames a busy consumer never saw
+  uint32_t bytesServed;
+};
+
+class AsyncMJPEGClient {
+  friend class AsyncMJPEGServer;
+  public:
+    AsyncMJPEGClient(AsyncClient* client, AsyncMJPEGServer* server);
+    ~AsyncMJPEGClient();
+    /**
+     * True while the client is waiting for, or sending, frames
+     */
+    bool wantsFrames();
+    /**
+     * Queue as much as the TCP window allows; called on ACKs, polls and new frames
+     */
+    void sendMore();
+
+  private:
+    enum State {
+      AwaitingRequest,
+      WaitingForFrame,
+      SendingFrame,
+      AwaitingAcks,
+      Closing
+    };
+    void handleData(char* data, size_t len);
+    bool startFrame();
+    AsyncClient* _tcp_client;
+    AsyncMJPEGServer* server;
+    State state;
+    bool isStream;
+    bool sentStreamHeader;
+    char _requestBuffer[HTTP_MAX_REQUEST_SIZE + 1];
+    size_t _requestLength;
+    char header[HTTP_MAX_HEADER_SIZE];
+    size_t headerLength;
+    std::shared_ptr<void> frame; // keeps the JPEG alive while lwIP references it
+    const uint8_t* frameData;
+    size_t frameLength;
+    size_t frameQueued;
+    uint32_t frameId;            // id of the last frame we started sending
+    uint32_t bytesQueued;        // everything handed to lwIP on this connection
+    uint32_t bytesAcked;
+};
+
+class AsyncMJPEGServer {
+  friend class AsyncMJPEGClient;
+  public:
+    AsyncMJPEGServer(uint16_t port);
+    void begin();
+    void end();
+    /**
+     * True if any HTTP consumer is waiting for or sending a frame; when
+     * false pushFrame doesn't even hold on to the frame
+     */
+    bool hasConsumers();
+    /**
+     * True if any HTTP consumer is idle waiting for its next frame, i.e.
+     * not still sending the previous one; this is the demand pull mode
+     * requests frames for
+     */
+    bool hasWaitingConsumers();
+    /**
+     * Publish a new JPEG; called by AsyncRTSPServer::pushFrame
+     */
+    void pushFrame(const uint8_t* data, size_t length, std::shared_ptr<void> image);
+    /**
+     * Called by a client when its TCP connection has gone away;
+     * destroys the client and returns its slot to the pool
+     */
+    void releaseClient(AsyncMJPEGClient* client);
+    MJPEGServerStats getStats();
+
+  private:
+    /**
+     * Copy out the latest frame if it is newer than lastFrameId;
+     * returns false if there is nothing new
+     */
+    bool getLatestFrame(uint32_t lastFrameId, std::shared_ptr<void>* image, const uint8_t** data, size_t* length, uint32_t* id);
+    /**
+     * Drop our reference to the latest frame once no consumer still needs it,
+     * so an idle or slow HTTP client never pins a camera buffer
+     */
+    void releaseUnwantedFrame();
+    AsyncServer _server;
+    AsyncMJPEGClient* clients[RTSP_MAX_HTTP_CLIENTS]; // nullptr when the slot is free
+    alignas(AsyncMJPEGClient) uint8_t clientStorage[RTSP_MAX_HTTP_CLIENTS][sizeof(AsyncMJPEGClient)];
+    std::shared_ptr<void> latestFrame;
+    const uint8_t* latestData;
+    size_t latestLength;
+    uint32_t latestFrameId; // 0 means no frame yet
+    portMUX_TYPE frameMux;  // guards the latest frame fields
+    // serialises client state between the async_tcp task and whoever calls pushFrame;
+    // recursive because closing a connection fires onDisconnect on the same task
+    SemaphoreHandle_t clientLock;
+    StaticSemaphore_t clientLockBuffer;
+    MJPEGServerStats stats;
+};
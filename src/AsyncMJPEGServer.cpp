@@ -0,0 +1,362 @@
+/**
+ * HTTP snapshot / MJPEG responder sharing frames with AsyncRTSPServer
+ * Multipart streams: https://datatracker.ietf.org/doc/html/rfc2046#section-5.1
+ */
+
+#include "AsyncMJPEG.h"
+#include <new>
+
+AsyncMJPEGServer::AsyncMJPEGServer(uint16_t port) : _server(port)
+{
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    this->clients[i] = nullptr;
+  }
+  this->latestData = nullptr;
+  this->latestLength = 0;
+  this->latestFrameId = 0;
+  this->frameMux = portMUX_INITIALIZER_UNLOCKED;
+  this->clientLock = xSemaphoreCreateRecursiveMutexStatic(&this->clientLockBuffer);
+  this->stats = {};
+
+  _server.onClient([this](void *s, AsyncClient *c)
+                   {
+                     AsyncMJPEGServer *https = (AsyncMJPEGServer *)s;
+
+                     xSemaphoreTakeRecursive(https->clientLock, portMAX_DELAY);
+                     for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+                       if (https->clients[i] == nullptr) {
+                         // construct the consumer in its preallocated slot
+                         https->clients[i] = new (https->clientStorage[i]) AsyncMJPEGClient(c, https);
+                         xSemaphoreGiveRecursive(https->clientLock);
+                         return;
+                       }
+                     }
+                     xSemaphoreGiveRecursive(https->clientLock);
+                     // no onDisconnect handler owns it, so AsyncTCP would leak it
+                     c->close(true);
+                     delete c;
+                   },
+                   this);
+}
+
+void AsyncMJPEGServer::begin()
+{
+  _server.setNoDelay(true);
+  _server.begin();
+}
+
+void AsyncMJPEGServer::end()
+{
+  _server.end();
+}
+
+bool AsyncMJPEGServer::hasConsumers()
+{
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->wantsFrames()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool AsyncMJPEGServer::hasWaitingConsumers()
+{
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->state == AsyncMJPEGClient::WaitingForFrame) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AsyncMJPEGServer::pushFrame(const uint8_t *data, size_t length, std::shared_ptr<void> image)
+{
+  if (!this->hasConsumers())
+  {
+    return;
+  }
+
+  // swap under the lock, but let the previous frame go (and possibly run its deleter) outside of it
+  std::shared_ptr<void> previous = image;
+  portENTER_CRITICAL(&this->frameMux);
+  this->latestFrame.swap(previous);
+  this->latestData = data;
+  this->latestLength = length;
+  this->latestFrameId++;
+  if (this->latestFrameId == 0) {
+    this->latestFrameId = 1;
+  }
+  portEXIT_CRITICAL(&this->frameMux);
+  previous = nullptr;
+
+  // wake consumers that are idle waiting for this frame
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->wantsFrames()) {
+      this->clients[i]->sendMore();
+    }
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+
+  this->releaseUnwantedFrame();
+}
+
+void AsyncMJPEGServer::releaseUnwantedFrame()
+{
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  bool wanted = false;
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->wantsFrames() && this->clients[i]->frameId != this->latestFrameId) {
+      wanted = true;
+    }
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+  if (wanted) {
+    return;
+  }
+
+  std::shared_ptr<void> previous;
+  portENTER_CRITICAL(&this->frameMux);
+  this->latestFrame.swap(previous);
+  this->latestData = nullptr;
+  this->latestLength = 0;
+  portEXIT_CRITICAL(&this->frameMux);
+}
+
+bool AsyncMJPEGServer::getLatestFrame(uint32_t lastFrameId, std::shared_ptr<void> *image, const uint8_t **data, size_t *length, uint32_t *id)
+{
+  portENTER_CRITICAL(&this->frameMux);
+  bool available = this->latestData != nullptr && this->latestFrameId != lastFrameId;
+  if (available) {
+    *image = this->latestFrame;
+    *data = this->latestData;
+    *length = this->latestLength;
+    *id = this->latestFrameId;
+  }
+  portEXIT_CRITICAL(&this->frameMux);
+  return available;
+}
+
+void AsyncMJPEGServer::releaseClient(AsyncMJPEGClient *client)
+{
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->clients[i] == client) {
+      this->clients[i] = nullptr;
+      client->~AsyncMJPEGClient();
+      break;
+    }
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+  this->releaseUnwantedFrame();
+}
+
+MJPEGServerStats AsyncMJPEGServer::getStats()
+{
+  return this->stats;
+}
+
+/**
+ * Sets up a new HTTP consumer; nothing is sent until the request line has arrived
+ */
+AsyncMJPEGClient::AsyncMJPEGClient(AsyncClient *c, AsyncMJPEGServer *server)
+{
+  this->_tcp_client = c;
+  this->server = server;
+  this->state = AwaitingRequest;
+  this->isStream = false;
+  this->sentStreamHeader = false;
+  this->_requestLength = 0;
+  this->headerLength = 0;
+  this->frameData = nullptr;
+  this->frameLength = 0;
+  this->frameQueued = 0;
+  this->frameId = 0;
+  this->bytesQueued = 0;
+  this->bytesAcked = 0;
+
+  // each handler may close the connection, and the disconnect handler deletes
+  // the AsyncClient along with these closures; so take the lock through a
+  // local copy and touch nothing captured once the work is done
+  c->onData([this](void *, AsyncClient *, void *data, size_t len) {
+    SemaphoreHandle_t lock = this->server->clientLock;
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    this->handleData((char *)data, len);
+    xSemaphoreGiveRecursive(lock);
+  });
+
+  c->onAck([this](void *, AsyncClient *, size_t len, uint32_t) {
+    SemaphoreHandle_t lock = this->server->clientLock;
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    this->bytesAcked += len;
+    this->sendMore();
+    xSemaphoreGiveRecursive(lock);
+  });
+
+  c->onPoll([this](void *, AsyncClient *) {
+    SemaphoreHandle_t lock = this->server->clientLock;
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    this->sendMore();
+    xSemaphoreGiveRecursive(lock);
+  });
+
+  c->onDisconnect([this](void *, AsyncClient *c) {
+    // AsyncTCP leaves freeing the connection to us
+    this->server->releaseClient(this);
+    delete c;
+  });
+}
+
+AsyncMJPEGClient::~AsyncMJPEGClient()
+{
+  this->frame = nullptr;
+}
+
+bool AsyncMJPEGClient::wantsFrames()
+{
+  return this->state == WaitingForFrame || this->state == SendingFrame || this->state == AwaitingAcks;
+}
+
+void AsyncMJPEGClient::handleData(char *data, size_t len)
+{
+  if (this->state != AwaitingRequest) {
+    return; // we don't support pipelining; ignore anything after the request
+  }
+  size_t copy = min(len, HTTP_MAX_REQUEST_SIZE - this->_requestLength);
+  memcpy(this->_requestBuffer + this->_requestLength, data, copy);
+  this->_requestLength += copy;
+  this->_requestBuffer[this->_requestLength] = 0;
+
+  char *lineEnd = strstr(this->_requestBuffer, "\r\n");
+  if (lineEnd == nullptr) {
+    if (this->_requestLength == HTTP_MAX_REQUEST_SIZE) {
+      this->_tcp_client->close(true);
+    }
+    return;
+  }
+  *lineEnd = 0;
+
+  if (strncmp(this->_requestBuffer, "GET /snapshot.jpg ", 18) == 0) {
+    this->isStream = false;
+  }
+  else if (strncmp(this->_requestBuffer, "GET /stream ", 12) == 0) {
+    this->isStream = true;
+  }
+  else {
+    this->state = Closing;
+    const char *notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    this->_tcp_client->write(notFound);
+    this->_tcp_client->close();
+    return;
+  }
+  // the frame is sent when the next one is pushed; it must not be older than the request
+  this->frameId = this->server->latestFrameId;
+  this->state = WaitingForFrame;
+}
+
+/**
+ * Take a reference to the latest frame and format the headers that precede it
+ */
+bool AsyncMJPEGClient::startFrame()
+{
+  uint32_t previousId = this->frameId;
+  if (!this->server->getLatestFrame(previousId, &this->frame, &this->frameData, &this->frameLength, &this->frameId)) {
+    return false;
+  }
+  if (previousId != 0 && this->frameId - previousId > 1) {
+    this->server->stats.framesSkipped += this->frameId - previousId - 1;
+  }
+
+  int len = 0;
+  if (!this->isStream) {
+    len = snprintf(this->header, sizeof(this->header),
+      "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+      (unsigned)this->frameLength);
+  }
+  else {
+    if (!this->sentStreamHeader) {
+      len = snprintf(this->header, sizeof(this->header),
+        "HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace;boundary=" HTTP_MJPEG_BOUNDARY "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n");
+      this->sentStreamHeader = true;
+    }
+    len += snprintf(this->header + len, sizeof(this->header) - len,
+      "--" HTTP_MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+      (unsigned)this->frameLength);
+  }
+  this->server->releaseUnwantedFrame();
+
+  this->headerLength = min((size_t)len, sizeof(this->header) - 1);
+  this->frameQueued = 0;
+  this->state = SendingFrame;
+  return true;
+}
+
+void AsyncMJPEGClient::sendMore()
+{
+  while (true) {
+    if (this->state == WaitingForFrame) {
+      if (!this->startFrame()) {
+        return;
+      }
+    }
+
+    if (this->state == SendingFrame) {
+      if (this->headerLength > 0) {
+        // headers are tiny; let AsyncTCP copy them
+        if (this->_tcp_client->space() < this->headerLength) {
+          return;
+        }
+        this->bytesQueued += this->_tcp_client->add(this->header, this->headerLength);
+        this->headerLength = 0;
+      }
+      while (this->frameQueued < this->frameLength) {
+        size_t space = this->_tcp_client->space();
+        if (space == 0) {
+          this->_tcp_client->send();
+          return;
+        }
+        // no ASYNC_WRITE_FLAG_COPY: lwIP references the frame until it is ACKed
+        size_t added = this->_tcp_client->add(
+          (const char *)this->frameData + this->frameQueued,
+          min(space, this->frameLength - this->frameQueued),
+          0);
+        if (added == 0) {
+          this->_tcp_client->send();
+          return;
+        }
+        this->frameQueued += added;
+        this->bytesQueued += added;
+      }
+      if (this->isStream) {
+        if (this->_tcp_client->space() < 2) {
+          this->_tcp_client->send();
+          return;
+        }
+        this->bytesQueued += this->_tcp_client->add("\r\n", 2);
+      }
+      this->_tcp_client->send();
+      this->server->stats.framesServed++;
+      this->server->stats.bytesServed += this->frameLength;
+      this->state = AwaitingAcks;
+    }
+
+    if (this->state == AwaitingAcks) {
+      if (this->bytesAcked < this->bytesQueued) {
+        return;
+      }
+      // lwIP is done with the frame; let the camera have it back
+      this->frame = nullptr;
+      this->frameData = nullptr;
+      if (!this->isStream) {
+        this->state = Closing;
+        this->_tcp_client->close();
+        return; // the disconnect callback may already have destroyed us
+      }
+      this->state = WaitingForFrame;
+      continue;
+    }
+
+    return;
+  }
+}
@@ -15,12 +15,75 @@
 #include <WiFiUdp.h>
 #include <stdio.h>
 #include "JPEGHelpers.h"
+#include "RTSPLog.h"
+#include "AsyncMJPEG.h"
 #include <memory>
 
 #define RTP_TIMESTAMP_HZ 90000 // Hz per RFC 2435
 
+/**
+ * Compile-time capacity limits.  Every session, packet and parse buffer is
+ * sized from these, so once begin() has been called the library makes no
+ * heap allocations of its own (linux/rtsp_alloc_test.cpp checks this); override
+ * them with build flags (-DRTSP_MAX_CLIENTS=2 ...).
+ *
+ * What it can't vouch for is the network stack underneath: AsyncTCP still
+ * allocates an AsyncClient per accepted connection, lwIP allocates pbufs for
+ * queued TCP data, and WiFiUDP::parsePacket allocates its receive buffer.
+ * Set the callbacks (onClient, setLogFunction, ...) before begin(); storing
+ * a capturing lambda in a std::function may allocate, calling it doesn't.
+ * The String returning helpers (getFriendlyName, toString) allocate, so keep
+ * them out of long running code.
+ */
+#ifndef RTSP_MAX_CLIENTS
+#define RTSP_MAX_CLIENTS 4 // concurrent RTSP sessions; further connections are refused
+#endif
+#ifndef RTSP_MAX_PACKET_SIZE
+#define RTSP_MAX_PACKET_SIZE 2048 // largest RTP packet, including the interleaved header
+#endif
+#ifndef RTSP_MAX_REQUEST_SIZE
+#define RTSP_MAX_REQUEST_SIZE 1024 // largest RTSP request we will buffer from a client
+#endif
+#ifndef RTSP_MAX_RESPONSE_SIZE
+#define RTSP_MAX_RESPONSE_SIZE 768 // largest RTSP response, headers and body
+#endif
+#ifndef RTSP_MAX_SDP_SIZE
+#define RTSP_MAX_SDP_SIZE 384 // session description returned by DESCRIBE
+#endif
+#ifndef RTSP_MAX_RESPONSE_HEADERS_SIZE
+#define RTSP_MAX_RESPONSE_HEADERS_SIZE 256 // method specific response headers
+#endif
+#ifndef RTSP_RTP_SERVER_PORT
+#define RTSP_RTP_SERVER_PORT 8830 // local port RTP is sent from
+#endif
+#ifndef RTSP_RTCP_SERVER_PORT
+#define RTSP_RTCP_SERVER_PORT 8831 // local port we listen on for RTCP feedback
+#endif
+#ifndef RTSP_MAX_RTCP_SIZE
+#define RTSP_MAX_RTCP_SIZE 512 // largest compound RTCP packet we will read
+#endif
+#ifndef RTSP_NACK_HISTORY_SIZE
+#define RTSP_NACK_HISTORY_SIZE 128 // sent fragments remembered for retransmission
+#endif
+#ifndef RTSP_NACK_MAX_RETRANSMITS_PER_SECOND
+#define RTSP_NACK_MAX_RETRANSMITS_PER_SECOND 100
+#endif
+#ifndef RTSP_MAX_FRAME_RATE
+#define RTSP_MAX_FRAME_RATE 30 // default cap on frames requested per second in pull mode
+#endif
+#ifndef RTSP_FRAME_REQUEST_TIMEOUT_MS
+#define RTSP_FRAME_REQUEST_TIMEOUT_MS 1000 // ask the frame source again if a requested frame never arrives
+#endif
+#define RTSP_LOG_ENTRY_SIZE 200
+
+#include "RTPFEC.h"
+
 typedef std::function<void (void *)> RTSPConnectHandler;
-typedef std::function<void (String ) > LogFunction;
+/**
+ * Receives each formatted log line with its RTSP_LOG_LEVEL_*; the line is
+ * only valid for the duration of the call
+ */
+typedef std::function<void (uint8_t level, const char* line)> LogFunction;
 
 struct dimensions {
   uint width;
@@ -34,6 +97,58 @@ class AsyncRTSPRequest;
 class AsyncRTSPResponse;
 
 
+/**
+ * Per-session delivery counters, as seen from the sending side.
+ * A frame counts as complete when every one of its fragments was
+ * accepted by the UDP stack.
+ */
+struct RTSPClientStats {
+  uint32_t packetsSent;
+  uint32_t packetsFailed;     // fragments the UDP stack refused or, on a queueing backend, dropped later (usually out of buffers)
+  uint32_t bytesSent;
+  uint32_t framesComplete;
+  uint32_t framesIncomplete;
+  uint32_t jitterMicros;      // smoothed inter-packet interval variation, RFC 3550 section 6.4.1 style
+  uint32_t lastPacketMicros;
+  uint32_t lastIntervalMicros;
+  uint32_t streamingSinceMillis;
+  uint32_t fecPacketsSent;
+  uint32_t fecBytesSent;
+  uint32_t nacksReceived;     // sequence numbers the client asked for again
+  uint32_t nacksServed;       // ... that we retransmitted
+  uint32_t nacksExpired;      // ... whose fragment or frame was no longer buffered
+  uint32_t nacksRateLimited;  // ... that we skipped to stay under RTSP_NACK_MAX_RETRANSMITS_PER_SECOND
+  uint8_t frameRate;          // frames per second this session keeps up with; halved when a frame fails to send
+  bool currentFrameFailed;
+};
+
+/**
+ * Server wide packetization counters; the CPU times are
+ * accumulated over every frame sent since begin()
+ */
+struct RTSPServerStats {
+  uint32_t framesSent;
+  uint32_t framesReplaced;    // frames pushed while the previous one was still being sent
+  uint32_t framesIdle;        // frames pushed while no client was playing
+  uint32_t framesRequested;   // frames asked of the frame source in pull mode
+  uint32_t framesSuppressed;  // frames not sent because they repeated the last one
+  uint64_t bytesSuppressed;   // scan bytes those frames would have sent, summed over playing clients
+  uint64_t prepMicros;        // time spent building RTP packets (a uint32_t wraps after ~72 minutes)
+  uint64_t sendMicros;        // time spent handing packets to the UDP stack
+};
+
+/**
+ * A fragment we have sent, by reference: which frame (its RTP timestamp)
+ * and where in that frame's scan data it started.  Retransmissions are
+ * rebuilt from the frame buffer rather than kept as copies.
+ */
+struct RTPSentFragment {
+  uint16_t sequenceNumber;
+  uint32_t timestamp;
+  uint32_t offset;
+  bool valid;
+};
+
 struct RTPBuffferPreparationResult {
   int offset;
   int bufferSize;
@@ -44,31 +159,50 @@ struct RTPBuffferPreparationResult {
 
 class AsyncRTSPClient {
   friend class AsyncRTSPRequest;
+  friend class AsyncRTSPServer;
   public:
     AsyncRTSPClient(AsyncClient* client, AsyncRTSPServer * server);
     ~AsyncRTSPClient();
-    void PushRTPBuffer(const char* RTPBuffer, size_t length);
+    void PushRTPBuffer(const char* RTPBuffer, size_t length, bool isLastFragment);
+    void PushFECBuffer(const char* FECBuffer, size_t length);
+    /**
+     * True if an RTCP packet from ip:port belongs to this session
+     */
+    bool isRTCPSource(IPAddress ip, uint16_t port);
     String getFriendlyName();
+    const RTSPClientStats& getStats();
     boolean getIsCurrentlyStreaming();
     void stopStreaming();
-    WiFiUDP udp;
 
   private:
+    bool sendUDPPacket(const char* buffer, size_t length, uint16_t port, bool retransmission = false);
+    /**
+     * A datagram sendUDPPacket reported as sent was dropped afterwards
+     * (WiFiUDP backends that queue, see WIFIUDP_HAS_DROP_HANDLER); move it
+     * to the failed side of the stats
+     */
+    void packetDropped(const uint8_t* packet, size_t length, bool retransmission);
+    void handleData(char* data, size_t len);
     void handleRTSPRequest(AsyncRTSPRequest*, AsyncRTSPResponse*);
     AsyncClient * _tcp_client;
     AsyncRTSPServer * server;
     boolean _isCurrentlyStreaming;
-    String _temp;
+    char _requestBuffer[RTSP_MAX_REQUEST_SIZE + 1]; // +1 so the request can always be null terminated
+    size_t _requestLength;
     int _RTPPortInt;
-    String _RTPPort;
-    String _RTCPPort;
+    int _RTCPPortInt;
+    int _FECPortInt;            // 0 unless the client SETUP the FEC stream
+    uint32_t _lastFrameTimestamp; // RTP timestamp of the last frame we finished sending
+    bool _lastFrameComplete;    // ... and whether it was counted in framesComplete
     uint RtspSessionID;
+    RTSPClientStats _stats;
   
 };
 
 
 
 class AsyncRTSPServer {
+  friend class AsyncRTSPClient;
   public:
     AsyncRTSPServer(uint16_t port, dimensions dim);
     ~AsyncRTSPServer();
@@ -78,16 +212,107 @@ class AsyncRTSPServer {
     void onClient(RTSPConnectHandler callback, void* arg);
     void pushFrame(uint8_t* data, size_t length, std::shared_ptr<void> image);
     void onFrameFinished(std::function<void ()> callback, void* arg);
+    /**
+     * Pull mode: instead of pushing at the camera's rate, let tick() ask
+     * for frames.  The callback is invoked only when a client is PLAYing
+     * or an HTTP consumer (see setHTTPServer) is idle waiting for its next
+     * frame, the previous frame has been sent, and no faster than the
+     * highest rate any playing client keeps up with (the max frame rate
+     * while an HTTP consumer waits); it
+     * should capture and pushFrame() (now or later, from another task).
+     * Nothing is requested while all clients are paused or torn down and
+     * no HTTP consumer is waiting.
+     * */
+    void setFrameSource(std::function<void ()> callback, void* arg);
+    /**
+     * Upper bound on the pull mode request rate (frames per second)
+     * */
+    void setMaxFrameRate(uint8_t fps);
+    uint8_t getMaxFrameRate();
     void setLogFunction(LogFunction logger, void* arg);
-    void writeLog(String log);
+    /**
+     * Deliver a log line immediately on the calling task;
+     * the library itself logs through the deferred RTSP_LOG* macros
+     * */
+    void writeLog(uint8_t level, const char* line);
+    /**
+     * Queue a log entry for deferred formatting; use the RTSP_LOG* macros
+     * rather than calling this directly so disabled levels compile out
+     * */
+    template<typename... Args>
+    void queueLog(uint8_t level, const char* format, const char* text, Args... args) {
+      static_assert(sizeof...(Args) <= RTSP_LOG_MAX_ARGS, "too many log arguments");
+      uint32_t packed[RTSP_LOG_MAX_ARGS + 1] = {static_cast<uint32_t>(args)...};
+      this->pushLogEntry(level, format, text, packed);
+    }
+    /**
+     * Format and deliver queued log entries to the log function.
+     * Call this from a low priority context such as the Arduino loop
+     * */
+    void processLog();
     int GetRTSPServerPort();
     int GetRTCPServerPort();
     boolean hasClients();
+    /**
+     * True while a frame is part way through being sent; a loop that
+     * sleeps between tick() calls should not sleep while this is set
+     * */
+    bool isSendingFrame();
+    /**
+     * Delivery counters for the session in the given pool slot
+     * (0 .. RTSP_MAX_CLIENTS-1); returns false if the slot is free
+     * */
+    bool getClientStats(int slot, RTSPClientStats* stats);
+    RTSPServerStats getServerStats();
+    /**
+     * Send one RFC 5109 XOR parity packet for every k media fragments
+     * (1-16); 0 disables FEC.  While k > 0, DESCRIBE offers the parity as
+     * a separate stream (RFC 5109 section 14.1) and only sessions that
+     * SETUP that stream receive it; frames that start while none of them
+     * is playing aren't encoded at all.  A new k applies to them from the
+     * next group; 0 stops their parity.
+     * */
+    void setFECGroupSize(uint8_t k);
+    uint8_t getFECGroupSize();
+    /**
+     * Answer RTCP generic NACKs (RFC 4585) by resending the requested
+     * fragments, announced in the SDP as a=rtcp-fb:26 nack on an RTP/AVPF
+     * media line (and RTP/AVPF in the SETUP reply).  While enabled
+     * the most recently sent frame is held (and its shared_ptr kept) until the
+     * next frame finishes sending, so plan for one extra camera frame buffer.
+     * */
+    void setNACKEnabled(bool enabled);
+    bool getNACKEnabled();
+    /**
+     * Also publish every pushed frame to an HTTP snapshot/MJPEG server,
+     * whether or not any RTSP client is playing; nullptr detaches it
+     * */
+    void setHTTPServer(AsyncMJPEGServer* server);
+    /**
+     * Don't send frames that repeat the last frame sent, but still send one
+     * at least every refreshMillis; 0 disables.  Frames are compared by a
+     * hash of each restart interval (see JPEGSceneSignature), and count as a
+     * repeat when at most changeThresholdPercent of the picture differs.
+     * Without restart markers in the JPEG only identical frames are repeats.
+     * RTP timestamps keep following the pushed frames, so players see a
+     * longer frame, not a slower clock.
+     * */
+    void setSceneSuppression(uint32_t refreshMillis, uint8_t changeThresholdPercent = 0);
+    /**
+     * Send the next pushed frame even if it repeats the last one;
+     * called when a session starts playing
+     * */
+    void refreshScene();
     /**
     * Worker method to send RTP frames
     *   
     * */
     void tick();
+    /**
+     * Called by a client when its TCP connection has gone away;
+     * destroys the client and returns its slot to the pool
+     * */
+    void releaseClient(AsyncRTSPClient* client);
 
     //void streamImage();
   protected:
@@ -98,20 +323,54 @@ class AsyncRTSPServer {
     RTPBuffferPreparationResult bpr;
 
   private:
-    AsyncRTSPClient* client;
+    AsyncRTSPClient* clients[RTSP_MAX_CLIENTS]; // nullptr when the slot is free
+    // backing storage for the client pool; clients are constructed in place on connect
+    alignas(AsyncRTSPClient) uint8_t clientStorage[RTSP_MAX_CLIENTS][sizeof(AsyncRTSPClient)];
+    // serialises the session pool between the async_tcp task (connect, requests,
+    // disconnect) and the task calling tick() and pushFrame(); recursive because
+    // tick() calls back into pushFrame() through the frame source
+    SemaphoreHandle_t clientLock;
+    StaticSemaphore_t clientLockBuffer;
     RTSPConnectHandler connectCallback;
     LogFunction loggerCallback;
+    void pushLogEntry(uint8_t level, const char* format, const char* text, const uint32_t* args);
+    RTSPLogEntry logQueue[RTSP_LOG_QUEUE_SIZE];
+    uint8_t logHead; // next entry to format
+    uint8_t logTail; // next free entry
+    uint32_t logDropped;
+    portMUX_TYPE logMux;
     std::function<void ()> frameFinishedCallback;
+    std::function<void ()> frameSourceCallback;
+    void* thatsource;
+    void requestFrame();
+    bool frameRequestPending;
+    uint32_t lastFrameRequestMillis;
+    uint8_t maxFrameRate;
     int RtpServerPort;
     int RtcpServerPort;
-    char* RTPBuffer; // Note: we assume single threaded, this large buf we keep off of the tiny stack
+    char RTPBuffer[RTSP_MAX_PACKET_SIZE]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
+    char FECBuffer[RTSP_MAX_PACKET_SIZE];
+    RTPFECEncoder fec;
+    bool fecActive; // a playing session had SETUP the FEC stream when the current frame started
+    WiFiUDP rtpUdp; // shared by every session, begun once so connecting clients don't allocate
+    WiFiUDP rtcpUdp;
+    uint8_t rtcpBuffer[RTSP_MAX_RTCP_SIZE];
+    void handleRTCP();
+    void handleNACK(AsyncRTSPClient* client, uint16_t sequenceNumber);
+    bool nackEnabled;
+    RTPSentFragment sentFragments[RTSP_NACK_HISTORY_SIZE]; // indexed by sequence number % size
+    DecodedJPEGFrame retainedFrame; // last completely sent frame, kept for retransmissions
+    std::shared_ptr<void> retainedFrameSharedPointer;
+    uint32_t retainedFrameTimestamp;
+    uint32_t currentFrameTimestamp;
+    uint32_t retransmitWindowMillis;
+    uint32_t retransmitsInWindow;
     void PrepareRTPBufferForClients(
       char* RTPBuffer, 
-      uint8_t* data, 
-      int length, 
-      RTPBuffferPreparationResult* bpr, 
-      unsigned const char * quant0tbl, 
-      unsigned const char * quant1tbl);
+      const DecodedJPEGFrame* frame, 
+      RTPBuffferPreparationResult* bpr,
+      u_short sequenceNumber,
+      uint32_t timestamp);
     u_short m_SequenceNumber;
     /**
      * Timestamp; measured as cycle count on a 90,000Hz per RFC 2435
@@ -120,13 +379,18 @@ class AsyncRTSPServer {
     uint32_t prevMsec;
     uint32_t curMsec;
     uint32_t deltams;
-    dimensions _dim;
+    dimensions _dim; // unused since the frame size is read from each image's SOF0 header
     std::shared_ptr<void> currentFrameSharedPointer;
-    uint32_t prepTime;
-    uint32_t sendTime;
-    int frameCount;
+    AsyncMJPEGServer* httpServer;
+    uint32_t sceneRefreshMillis;
+    uint8_t sceneChangeThreshold;
+    JPEGSceneSignature frameSignature;   // the frame being pushed
+    JPEGSceneSignature currentSignature; // the frame being sent
+    JPEGSceneSignature sentSignature;    // the last frame sent completely
+    RTSPServerStats stats;
     uint32_t lastFrameMillis;
-    char* logentry;
+    uint32_t lastStatsMillis;
+    char logentry[RTSP_LOG_ENTRY_SIZE];
    
     
 
@@ -137,37 +401,45 @@ class AsyncRTSPServer {
  */
 class AsyncRTSPRequest { 
   public:
-    AsyncRTSPRequest(String rawRequest);
-    ~AsyncRTSPRequest();
-    String rawRequest;
-    String Method;
-    String RequestURI;
-    String RTSPVersion;
-    String Body;
-    String Headers;
+    /**
+     * Parses the request in place; the request line and header lines are
+     * null terminated inside rawRequest, which must outlive this object
+     */
+    AsyncRTSPRequest(char* rawRequest, size_t length);
+    const char* Method;
+    const char* RequestURI;
+    const char* RTSPVersion;
     String toString();
 
-    String GetHeaderValue(String Header);
+    /**
+     * Returns the value of the named header (case insensitive),
+     * or an empty string if the request doesn't contain it
+     */
+    const char* GetHeaderValue(const char* Header);
 
 
   private:
+    char* Headers;
+    char* HeadersEnd;
 
 };
 
 class AsyncRTSPResponse { 
   public:
     AsyncRTSPResponse(AsyncClient* c, AsyncRTSPRequest* r);
-    ~AsyncRTSPResponse();
     int Status;
     void Send();
-    String Body;
-    String Headers;
+    /**
+     * Appends a printf-formatted header line; the format should end in \r\n
+     */
+    void AddHeader(const char* format, ...);
+    const char* Body;
 
   private:
     AsyncClient* _tcpClient;
     AsyncRTSPRequest* _request;
-    char * DateHeader();
-    String ContentLengthHeader();
+    char Headers[RTSP_MAX_RESPONSE_HEADERS_SIZE];
+    size_t headersLength;
 
 };
 
@@ -211,5 +483,9 @@ Media description
         a=* (zero or more media attribute lines)
 */
   public:
-    static String toString();
+    /**
+     * Writes the session description for server into buffer;
+     * returns the length it would have had, like snprintf
+     */
+    static int toString(char* buffer, size_t size, AsyncRTSPServer* server);
 };
\ No newline at end of file
@@ -1,124 +1,176 @@
 /**
  * This library is an adaptation of https://github.com/geeksville/Micro-RTSP
  * suited for use with the AsyncTCP library https://github.com/me-no-dev/AsyncTCP
- * 
+ *
  */
 
 #include "AsyncRTSP.h"
+#include <stdarg.h>
 
 
 #define getRandom() random(65536)
 
 /**
  * Sets up a new client connection / session
- * 
+ *
  * Creates the callback function to listen for incoming TCP data
  * and parses to RTSP messages
- * 
+ *
  */
 AsyncRTSPClient::AsyncRTSPClient(AsyncClient* c, AsyncRTSPServer * server)
 {
-  udp.begin(8830);
   this->_tcp_client = c;
   this->server = server;
   this->_isCurrentlyStreaming = false;
+  this->_requestLength = 0;
+  this->_RTPPortInt = 0;
+  this->_RTCPPortInt = 0;
+  this->_FECPortInt = 0;
+  this->_lastFrameTimestamp = 0;
+  this->_lastFrameComplete = false;
+  this->_stats = {};
   this->RtspSessionID = getRandom();
   this->RtspSessionID |= 0x80000000;
-  
-  String t = "Connected new RTSP Client: " + getFriendlyName();
-  this->server->writeLog(t);
+
+  RTSP_LOGI(server, "Connected new RTSP Client: %u.%u.%u.%u", RTSP_LOG_IP_ARGS(c->remoteIP()));
 
   //void*, AsyncClient*, void *data, size_t len
-  c->onData([this](void* p, AsyncClient* c, void *data, size_t len) {
-    char *str = (char*)data;
-    // super janky way to pass a null-terminated char array to the string
-    // and then just add the last char to the end of the string
-    
-    char last = str[len-1];
-    str[len-1] = 0;
-    this->_temp.reserve(_temp.length() + len);
-    _temp.concat(str);
-    _temp.concat(last);
-
-    // TODO: this may be naieve to assume a complete RTSP request
-    int endS = _temp.indexOf("\r\n\r\n");
-    char e[10];
-    char t[10];
-    itoa(endS,e,10);
-    itoa(_temp.length(),t,10);
-
-    if (endS == _temp.length()-4 ) {
-      AsyncRTSPRequest* req = new AsyncRTSPRequest(_temp);
-      AsyncRTSPResponse* resp = new AsyncRTSPResponse(c, req);
-      this->handleRTSPRequest(req, resp);
-      _temp="";
-    }
+  // requests change session state that tick() reads on another task; the
+  // lock is copied first because a TEARDOWN may close (and free) the session
+  c->onData([this](void*, AsyncClient*, void *data, size_t len) {
+    SemaphoreHandle_t lock = this->server->clientLock;
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    this->handleData((char*)data, len);
+    xSemaphoreGiveRecursive(lock);
+  });
 
+  c->onDisconnect([this](void*, AsyncClient* c) {
+    // AsyncTCP leaves freeing the connection to us; releaseClient waits
+    // for tick() to be done with the session, after which nothing else
+    // refers to this connection
+    this->server->releaseClient(this);
+    delete c;
   });
- 
-} 
+
+}
+
+AsyncRTSPClient::~AsyncRTSPClient() {
+}
+
+/**
+ * Buffers incoming TCP data in the fixed request buffer and dispatches
+ * each complete RTSP request (terminated by a blank line) as it arrives.
+ */
+void AsyncRTSPClient::handleData(char* data, size_t len) {
+  if (this->_requestLength + len > RTSP_MAX_REQUEST_SIZE) {
+    RTSP_LOGW(this->server, "Dropping oversized RTSP request (%u bytes)", this->_requestLength + len);
+    this->_requestLength = 0;
+    return;
+  }
+  memcpy(this->_requestBuffer + this->_requestLength, data, len);
+  this->_requestLength += len;
+  this->_requestBuffer[this->_requestLength] = 0;
+
+  char* end;
+  while ((end = strstr(this->_requestBuffer, "\r\n\r\n")) != nullptr) {
+    size_t requestLength = end + 4 - this->_requestBuffer;
+    // keep the first byte of whatever follows; the parser null terminates in place
+    char next = this->_requestBuffer[requestLength];
+    {
+      AsyncRTSPRequest req(this->_requestBuffer, requestLength);
+      AsyncRTSPResponse resp(this->_tcp_client, &req);
+      this->handleRTSPRequest(&req, &resp);
+    }
+    this->_requestBuffer[requestLength] = next;
+    this->_requestLength -= requestLength;
+    memmove(this->_requestBuffer, this->_requestBuffer + requestLength, this->_requestLength);
+    this->_requestBuffer[this->_requestLength] = 0;
+  }
+}
 
 
 void AsyncRTSPClient::handleRTSPRequest(AsyncRTSPRequest* req, AsyncRTSPResponse* res){
 
-  if(req->Method =="OPTIONS") {
+  if(strcmp(req->Method, "OPTIONS") == 0) {
     res->Status = 200;
-    res->Headers = "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n";
+    res->AddHeader("Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n");
     res->Send();
-    
+
   }
-  else if(req->Method=="DESCRIBE") {
+  else if(strcmp(req->Method, "DESCRIBE") == 0) {
     res->Status = 200;
-    res->Body = RTSPMediaLevelAttributes::toString();
+    char sdp[RTSP_MAX_SDP_SIZE];
+    RTSPMediaLevelAttributes::toString(sdp, sizeof(sdp), this->server);
+    res->Body = sdp;
     res->Send();
   }
-  else if(req->Method=="SETUP") {
-    String transport = req->GetHeaderValue("Transport");
-    int client_port = transport.indexOf("client_port=") + 12;
-    int dash = transport.indexOf("-",client_port);
-    int end = transport.indexOf(";",dash);
-    this->_RTPPort = transport.substring(client_port, dash);
-    this->_RTPPortInt = this->_RTPPort.toInt();
-    this->_RTCPPort = transport.substring(dash+1, end);
-    this->server->writeLog("RTP Port: " + this->_RTPPort+"; RTCP Port: " + this->_RTCPPort);
+  else if(strcmp(req->Method, "SETUP") == 0) {
+    const char* transport = req->GetHeaderValue("Transport");
+    const char* clientPort = strstr(transport, "client_port=");
+    // the FEC stream's a=control is "fec"; any other URI sets up the JPEG stream
+    const char* control = strrchr(req->RequestURI, '/');
+    bool fecStream = control != nullptr && strcmp(control + 1, "fec") == 0;
+    int rtpPort = 0;
+    int rtcpPort = 0;
+    if (clientPort != nullptr) {
+      char* dash;
+      rtpPort = strtol(clientPort + 12, &dash, 10);
+      rtcpPort = (*dash == '-') ? strtol(dash + 1, nullptr, 10) : rtpPort + 1;
+    }
+    if (fecStream) {
+      this->_FECPortInt = rtpPort;
+      RTSP_LOGD(this->server, "FEC Port: %u", this->_FECPortInt);
+    }
+    else {
+      this->_RTPPortInt = rtpPort;
+      this->_RTCPPortInt = rtcpPort;
+      RTSP_LOGD(this->server, "RTP Port: %u; RTCP Port: %u", this->_RTPPortInt, this->_RTCPPortInt);
+    }
     res->Status = 200;
 
-    char transportResponse[255];
-    sprintf(
-      transportResponse,
-      "Transport: RTP/AVP/UDP;unicast;destination=%s;client_port=%s-%s;server_port=%u-%u;mode=play\r\n",
-      this->_tcp_client->remoteIP().toString().c_str(),
-      this->_RTPPort.c_str(),
-      this->_RTCPPort.c_str(),
+    IPAddress remote = this->_tcp_client->remoteIP();
+    res->AddHeader(
+      "Transport: %s;unicast;destination=%u.%u.%u.%u;client_port=%d-%d;server_port=%u-%u;mode=play\r\n",
+      // NACK feedback needs the RFC 4585 profile on the stream the SDP offered it for
+      this->server->getNACKEnabled() && !fecStream ? "RTP/AVPF/UDP" : "RTP/AVP/UDP",
+      remote[0], remote[1], remote[2], remote[3],
+      rtpPort,
+      rtcpPort,
       this->server->GetRTSPServerPort(),
       this->server->GetRTCPServerPort()
       );
-
-    char sess[20];
-    sprintf(sess,"%u",this->RtspSessionID);
-
-
-
-    res->Headers = String(transportResponse) + "Session: " + String(sess)+"\r\n";
+    res->AddHeader("Session: %u\r\n", this->RtspSessionID);
     res->Send();
   }
-  else if(req->Method=="PLAY") {
+  else if(strcmp(req->Method, "PLAY") == 0) {
+    if (!this->_isCurrentlyStreaming) {
+      this->_stats.streamingSinceMillis = millis();
+      this->_stats.frameRate = this->server->getMaxFrameRate();
+      // a new viewer shouldn't wait for the scene to change to see its first frame
+      this->server->refreshScene();
+    }
     this->_isCurrentlyStreaming = true;
     res->Status = 200;
     res->Send();
   }
-  else if(req->Method=="TEARDOWN") {
+  else if(strcmp(req->Method, "PAUSE") == 0) {
+    this->_isCurrentlyStreaming = false;
+    res->Status = 200;
+    res->AddHeader("Session: %u\r\n", this->RtspSessionID);
+    res->Send();
+  }
+  else if(strcmp(req->Method, "TEARDOWN") == 0) {
     this->_isCurrentlyStreaming = false;
     res->Status = 200;
     res->Send();
   }
 
-  
+
   else {
-    this->server->writeLog("Could not handle " + req->Method +  " request: \n\n" + req->rawRequest);
+    RTSP_LOGW_S(this->server, "Could not handle %s request; seq: %u", req->Method, atoi(req->GetHeaderValue("CSeq")));
     return;
   }
-  this->server->writeLog("Handled " + req->Method +  " request from " + this->getFriendlyName() + ". seq: " + req->GetHeaderValue("CSeq"));
+  RTSP_LOGI_S(this->server, "Handled %s request from %u.%u.%u.%u. seq: %u", req->Method, RTSP_LOG_IP_ARGS(this->_tcp_client->remoteIP()), atoi(req->GetHeaderValue("CSeq")));
 }
 
 String AsyncRTSPClient::getFriendlyName() {
@@ -126,13 +178,105 @@ String AsyncRTSPClient::getFriendlyName() {
   return address;
 }
 
-void AsyncRTSPClient::PushRTPBuffer(const char* RTPBuffer, size_t length) {
-  udp.beginPacket(this->_tcp_client->remoteIP(),this->_RTPPortInt);
+/**
+ * Sends an RTP buffer (minus its 4 byte interleaved header) to one of the client's ports
+ */
+bool AsyncRTSPClient::sendUDPPacket(const char* buffer, size_t length, uint16_t port, bool retransmission) {
+  WiFiUDP& udp = this->server->rtpUdp;
+#ifdef WIFIUDP_HAS_DROP_HANDLER
+  udp.setDropTag(retransmission);
+#else
+  (void)retransmission;
+#endif
+  bool sent = udp.beginPacket(this->_tcp_client->remoteIP(), port);
+
+  const uint8_t* udpBuffer = (uint8_t*)(buffer+4);
+  sent = sent && udp.write(udpBuffer,length-4) == length-4;
+  return udp.endPacket() && sent;
+}
+
+void AsyncRTSPClient::PushRTPBuffer(const char* RTPBuffer, size_t length, bool isLastFragment) {
+  bool sent = this->sendUDPPacket(RTPBuffer, length, this->_RTPPortInt);
+
+  uint32_t now = micros();
+  if (sent) {
+    this->_stats.packetsSent++;
+    this->_stats.bytesSent += length-4;
+  }
+  else {
+    this->_stats.packetsFailed++;
+    this->_stats.currentFrameFailed = true;
+  }
+  if (this->_stats.lastPacketMicros != 0) {
+    uint32_t interval = now - this->_stats.lastPacketMicros;
+    int32_t d = (int32_t)(interval - this->_stats.lastIntervalMicros);
+    this->_stats.jitterMicros += ((d < 0 ? -d : d) - (int32_t)this->_stats.jitterMicros) / 16;
+    this->_stats.lastIntervalMicros = interval;
+  }
+  this->_stats.lastPacketMicros = now;
+
+  if (isLastFragment) {
+    const uint8_t* rtp = (const uint8_t*)RTPBuffer + 4;
+    this->_lastFrameTimestamp = (rtp[4] << 24) | (rtp[5] << 16) | (rtp[6] << 8) | rtp[7];
+    this->_lastFrameComplete = !this->_stats.currentFrameFailed;
+    // additive increase / multiplicative decrease of the rate we think this session can absorb
+    if (this->_stats.currentFrameFailed) {
+      this->_stats.framesIncomplete++;
+      this->_stats.frameRate = max(this->_stats.frameRate / 2, 1);
+    }
+    else {
+      this->_stats.framesComplete++;
+      if (this->_stats.frameRate < this->server->getMaxFrameRate()) {
+        this->_stats.frameRate++;
+      }
+    }
+    this->_stats.currentFrameFailed = false;
+  }
+}
+
+bool AsyncRTSPClient::isRTCPSource(IPAddress ip, uint16_t port) {
+  return port == this->_RTCPPortInt && ip == this->_tcp_client->remoteIP();
+}
+
+void AsyncRTSPClient::PushFECBuffer(const char* FECBuffer, size_t length) {
+  if (this->_FECPortInt == 0) {
+    return; // the client didn't set up the FEC stream
+  }
+  if (this->sendUDPPacket(FECBuffer, length, this->_FECPortInt)) {
+    this->_stats.fecPacketsSent++;
+    this->_stats.fecBytesSent += length-4;
+  }
+}
+
+void AsyncRTSPClient::packetDropped(const uint8_t* packet, size_t length, bool retransmission) {
+  if (retransmission) {
+    this->_stats.nacksServed--;
+    return;
+  }
+  if ((packet[1] & 0x7f) == RTP_FEC_PAYLOAD_TYPE) {
+    this->_stats.fecPacketsSent--;
+    this->_stats.fecBytesSent -= length;
+    return;
+  }
+  this->_stats.packetsSent--;
+  this->_stats.bytesSent -= length;
+  this->_stats.packetsFailed++;
+  uint32_t timestamp = (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+  if (timestamp != this->_lastFrameTimestamp) {
+    // still going out; PushRTPBuffer counts it when the last fragment is pushed
+    this->_stats.currentFrameFailed = true;
+  }
+  else if (this->_lastFrameComplete) {
+    // already counted complete (and the rate raised); count it as PushRTPBuffer would have
+    this->_stats.framesComplete--;
+    this->_stats.framesIncomplete++;
+    this->_stats.frameRate = max(this->_stats.frameRate / 2, 1);
+    this->_lastFrameComplete = false;
+  }
+}
 
-  const uint8_t* udpBuffer = (uint8_t*)(RTPBuffer+4);
-  udp.write(udpBuffer,length-4);
-  udp.endPacket();
-  //this->server->writeLog("Wrote UDP Packet to " + String(this->_RTPPortInt));
+const RTSPClientStats& AsyncRTSPClient::getStats() {
+  return this->_stats;
 }
 
 boolean AsyncRTSPClient::getIsCurrentlyStreaming() {
@@ -144,79 +288,147 @@ void AsyncRTSPClient::stopStreaming() {
 }
 
 
-AsyncRTSPRequest::AsyncRTSPRequest(String rawRequest) {
-  this->rawRequest = rawRequest;
-  int methodEnd = rawRequest.indexOf(" ");
-  this->Method = rawRequest.substring(0,methodEnd);
-
-  int uriEnd = rawRequest.indexOf(" ",methodEnd+1);
-  this->RequestURI = rawRequest.substring(methodEnd + 1, uriEnd);
+AsyncRTSPRequest::AsyncRTSPRequest(char* rawRequest, size_t length) {
+  rawRequest[length] = 0;
+  this->Method = "";
+  this->RequestURI = "";
+  this->RTSPVersion = "";
+  this->Headers = rawRequest + length;
+  this->HeadersEnd = rawRequest + length;
 
-  int requestLineEnd = rawRequest.indexOf("\r\n",uriEnd+1);
-  this->RTSPVersion = rawRequest.substring(uriEnd+1,requestLineEnd);
+  char* requestLineEnd = strstr(rawRequest, "\r\n");
+  if (requestLineEnd == nullptr) {
+    return;
+  }
+  *requestLineEnd = 0;
+
+  // request line: Method SP Request-URI SP RTSP-Version
+  this->Method = rawRequest;
+  char* methodEnd = strchr(rawRequest, ' ');
+  if (methodEnd != nullptr) {
+    *methodEnd = 0;
+    this->RequestURI = methodEnd + 1;
+    char* uriEnd = strchr(methodEnd + 1, ' ');
+    if (uriEnd != nullptr) {
+      *uriEnd = 0;
+      this->RTSPVersion = uriEnd + 1;
+    }
+  }
 
-  this->Headers = rawRequest.substring(requestLineEnd+2,rawRequest.length()-2);
+  // terminate each header line so GetHeaderValue can hand out pointers into the buffer
+  this->Headers = requestLineEnd + 2;
+  for (char* p = this->Headers; p < this->HeadersEnd; p++) {
+    if (*p == '\r') {
+      *p = 0;
+    }
+  }
 }
- 
+
 String AsyncRTSPRequest::toString() {
-  return "Method: " + this->Method +"\n"
+  return String("Method: ") + this->Method +"\n"
     + "URI: " + this->RequestURI + "\n"
     + "Version:" + this->RTSPVersion + "\n"
     + "Sequence: " + this->GetHeaderValue("CSeq");
 }
 
-String AsyncRTSPRequest::GetHeaderValue(String headerName) {
-  int headerLineStart = this->Headers.indexOf(headerName);
-  int headerNameEnd = this->Headers.indexOf(":",headerLineStart);
-  int headerLineEnd = this->Headers.indexOf("\r\n",headerLineStart);
-  return this->Headers.substring(headerNameEnd+2,headerLineEnd); // TODO, make sure we ignore whitespace after the colon
+const char* AsyncRTSPRequest::GetHeaderValue(const char* headerName) {
+  size_t nameLength = strlen(headerName);
+  char* line = this->Headers;
+  while (line < this->HeadersEnd) {
+    if (strncasecmp(line, headerName, nameLength) == 0 && line[nameLength] == ':') {
+      const char* value = line + nameLength + 1;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      return value;
+    }
+    // header lines were terminated as "\0\n" by the constructor
+    line += strlen(line) + 2;
+  }
+  return "";
 }
 
 AsyncRTSPResponse::AsyncRTSPResponse(AsyncClient* c, AsyncRTSPRequest* r)
-  :_tcpClient(c), _request(r)
+  :Status(0), Body(nullptr), _tcpClient(c), _request(r), headersLength(0)
   {
+    this->Headers[0] = 0;
+}
 
+void AsyncRTSPResponse::AddHeader(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(
+    this->Headers + this->headersLength,
+    sizeof(this->Headers) - this->headersLength,
+    format,
+    args);
+  va_end(args);
+  if (written > 0) {
+    this->headersLength = min(this->headersLength + written, sizeof(this->Headers) - 1);
+  }
 }
 
 void AsyncRTSPResponse::Send(){
-  String sendBody = String();
+  char sendBody[RTSP_MAX_RESPONSE_SIZE];
+  size_t len = 0;
+  // snprintf reports the untruncated length; clamp so a long body can't push us past the buffer
+  auto append = [&](int written) {
+    if (written > 0) {
+      len = min(len + written, sizeof(sendBody) - 1);
+    }
+  };
   if (this->Status == 200) {
-    sendBody += "RTSP/1.0 200 OK\r\nCSeq: " + _request->GetHeaderValue("CSeq") + "\r\n";
+    append(snprintf(sendBody + len, sizeof(sendBody) - len, "RTSP/1.0 200 OK\r\nCSeq: %s\r\n", _request->GetHeaderValue("CSeq")));
   }
-  sendBody += this->Headers;
-  if (this->Body.length() > 0) {
-    sendBody += this->DateHeader();
-    sendBody += this->ContentLengthHeader();
-    sendBody += "\r\n";
-    sendBody += this->Body;
+  append(snprintf(sendBody + len, sizeof(sendBody) - len, "%s", this->Headers));
+  if (this->Body != nullptr && this->Body[0] != 0) {
+    time_t tt = time(NULL);
+    append(strftime(sendBody + len, sizeof(sendBody) - len, "Date: %a, %b %d %Y %H:%M:%S GMT\r\n", gmtime(&tt)));
+    append(snprintf(sendBody + len, sizeof(sendBody) - len, "Content-Length: %u\r\n\r\n%s", (unsigned)strlen(this->Body) + 2, this->Body));
   }
   // TODO make sure we always end this packet with a fully blank line
-  sendBody += "\r\n";
-  this->_tcpClient->write(sendBody.c_str());
+  append(snprintf(sendBody + len, sizeof(sendBody) - len, "\r\n"));
+  this->_tcpClient->write(sendBody, len);
   this->_tcpClient->send();
 }
 
-String AsyncRTSPResponse::ContentLengthHeader() {
-  char t[10];
-  itoa(this->Body.length()+2,t,10);
-  return String("Content-Length: ") + t + "\r\n";
-}
-
-char * AsyncRTSPResponse::DateHeader() {
-  static char buf[200];
-  time_t tt = time(NULL);
-  strftime(buf, sizeof buf, "Date: %a, %b %d %Y %H:%M:%S GMT\r\n", gmtime(&tt));
-  return buf;
-}
-
 // https://www.ietf.org/rfc/rfc4566.txt page 21/22
-String RTSPMediaLevelAttributes::toString() {
-  return "v=0\r\n"
+int RTSPMediaLevelAttributes::toString(char* buffer, size_t size, AsyncRTSPServer* server) {
+  int len = snprintf(buffer, size,
+        "v=0\r\n"
         "o=d 1  1 IN IP4 0.0.0.0\r\n"
         "s=ESPHome RTSP Stream\r\n"
         // If the stop time is 0 then the session is unbounded. If the start time is also zero then the session is considered permanent. Unbounded and permanent sessions are discouraged but not prohibited.
-        "t=0 0\r\n" 
-        "m=video 0 RTP/AVP 26\r\n"
-        "c=IN IP4 0.0.0.0\r\n";
+        "t=0 0\r\n");
+  bool fec = server->getFECGroupSize() > 0;
+  if (fec) {
+    // RFC 5109 section 14.1: the parity goes out as a separate stream, tied to the one it protects by RFC 5888 grouping
+    len += snprintf(buffer + min((size_t)len, size), size - min((size_t)len, size),
+        "a=group:FEC 1 2\r\n");
+  }
+  // https://datatracker.ietf.org/doc/html/rfc4585#section-4.2: rtcp-fb is only defined under the AVPF profile
+  len += snprintf(buffer + min((size_t)len, size), size - min((size_t)len, size),
+      "m=video 0 %s 26\r\n"
+      "c=IN IP4 0.0.0.0\r\n",
+      server->getNACKEnabled() ? "RTP/AVPF" : "RTP/AVP");
+  if (fec) {
+    len += snprintf(buffer + min((size_t)len, size), size - min((size_t)len, size),
+        "a=control:video\r\n"
+        "a=mid:1\r\n");
+  }
+  if (server->getNACKEnabled()) {
+    len += snprintf(buffer + min((size_t)len, size), size - min((size_t)len, size),
+        "a=rtcp-fb:26 nack\r\n");
+  }
+  if (fec) {
+    len += snprintf(buffer + min((size_t)len, size), size - min((size_t)len, size),
+        "m=video 0 RTP/AVP %u\r\n"
+        "c=IN IP4 0.0.0.0\r\n"
+        "a=rtpmap:%u ulpfec/90000\r\n"
+        "a=control:fec\r\n"
+        "a=mid:2\r\n",
+        RTP_FEC_PAYLOAD_TYPE,
+        RTP_FEC_PAYLOAD_TYPE);
+  }
+  return len;
 }
-
@@ -6,74 +6,222 @@
  */
 
 #include "AsyncRTSP.h"
-#include "JPEGHelpers.cpp"
+#include <new>
 
 AsyncRTSPServer::AsyncRTSPServer(uint16_t port, dimensions dim) : _server(port),
                                                                   _dim(dim)
 {
 
-  this->client = nullptr;
+  for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+    this->clients[i] = nullptr;
+  }
   this->prevMsec = millis();
   this->curMsec = this->prevMsec;
-
-  this->RTPBuffer = new char[2048]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
+  this->m_SequenceNumber = 0;
+  this->m_Timestamp = 0;
+  this->RtpServerPort = RTSP_RTP_SERVER_PORT;
+  this->RtcpServerPort = RTSP_RTCP_SERVER_PORT;
+  this->clientLock = xSemaphoreCreateRecursiveMutexStatic(&this->clientLockBuffer);
 
   _server.onClient([this](void *s, AsyncClient *c)
                    {
                      AsyncRTSPServer *rtps = (AsyncRTSPServer *)s;
 
-                     rtps->client = new AsyncRTSPClient(c, this);
-                     rtps->connectCallback(rtps->that);
+                     xSemaphoreTakeRecursive(rtps->clientLock, portMAX_DELAY);
+                     for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+                       if (rtps->clients[i] == nullptr) {
+                         // construct the session in its preallocated slot
+                         rtps->clients[i] = new (rtps->clientStorage[i]) AsyncRTSPClient(c, this);
+                         xSemaphoreGiveRecursive(rtps->clientLock);
+                         rtps->connectCallback(rtps->that);
+                         return;
+                       }
+                     }
+                     xSemaphoreGiveRecursive(rtps->clientLock);
+                     RTSP_LOGW(rtps, "Refusing RTSP client; all %u session slots are in use", RTSP_MAX_CLIENTS);
+                     // no onDisconnect handler owns it, so AsyncTCP would leak it
+                     c->close(true);
+                     delete c;
                    },
                    this);
 
   this->loggerCallback = NULL;
-  this->currentFrame = {
-    nullptr,
-    nullptr,
-    nullptr,
-    0
-  };
+  this->currentFrame = {};
   this->bpr = {0, 0, false};
-  this->frameCount = 0;
-  this->sendTime = 0;
-  this->prepTime = 0;
+  this->stats = {};
   this->lastFrameMillis = 0;
-  this->logentry = new char[200];
+  this->lastStatsMillis = 0;
+  this->logHead = 0;
+  this->logTail = 0;
+  this->logDropped = 0;
+  this->logMux = portMUX_INITIALIZER_UNLOCKED;
+  this->nackEnabled = false;
+  this->fecActive = false;
+  this->httpServer = nullptr;
+  this->frameSourceCallback = nullptr;
+  this->frameRequestPending = false;
+  this->lastFrameRequestMillis = 0;
+  this->maxFrameRate = RTSP_MAX_FRAME_RATE;
+  this->sceneRefreshMillis = 0;
+  this->sceneChangeThreshold = 0;
+  this->currentSignature.bucketCount = 0;
+  this->sentSignature.bucketCount = 0;
+  for (int i = 0; i < RTSP_NACK_HISTORY_SIZE; i++) {
+    this->sentFragments[i].valid = false;
+  }
+  this->retainedFrame = {};
+  this->retainedFrameTimestamp = 0;
+  this->currentFrameTimestamp = 0;
+  this->retransmitWindowMillis = 0;
+  this->retransmitsInWindow = 0;
+
+}
 
+void AsyncRTSPServer::releaseClient(AsyncRTSPClient *client)
+{
+  // waits for tick() to finish with the session before it goes away
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+    if (this->clients[i] == client) {
+      this->clients[i] = nullptr;
+      client->~AsyncRTSPClient();
+      break;
+    }
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
 }
 
-void AsyncRTSPServer::writeLog(String log)
+void AsyncRTSPServer::writeLog(uint8_t level, const char *line)
 {
 
   if (this->loggerCallback != NULL)
   {
-    this->loggerCallback(log);
+    this->loggerCallback(level, line);
+  }
+}
+
+void AsyncRTSPServer::pushLogEntry(uint8_t level, const char *format, const char *text, const uint32_t *args)
+{
+  // nobody is listening; don't spend the cycles
+  if (!this->loggerCallback)
+  {
+    return;
+  }
+
+  portENTER_CRITICAL(&this->logMux);
+  uint8_t next = (this->logTail + 1) % RTSP_LOG_QUEUE_SIZE;
+  if (next == this->logHead)
+  {
+    this->logDropped++;
+    portEXIT_CRITICAL(&this->logMux);
+    return;
+  }
+  RTSPLogEntry *entry = &this->logQueue[this->logTail];
+  entry->format = format;
+  entry->level = level;
+  entry->hasText = text != nullptr;
+  if (entry->hasText)
+  {
+    strncpy(entry->text, text, RTSP_LOG_TEXT_SIZE - 1);
+    entry->text[RTSP_LOG_TEXT_SIZE - 1] = 0;
+  }
+  memcpy(entry->args, args, sizeof(entry->args));
+  this->logTail = next;
+  portEXIT_CRITICAL(&this->logMux);
+}
+
+void AsyncRTSPServer::processLog()
+{
+  while (true)
+  {
+    RTSPLogEntry entry;
+    uint32_t dropped;
+    portENTER_CRITICAL(&this->logMux);
+    if (this->logHead == this->logTail)
+    {
+      portEXIT_CRITICAL(&this->logMux);
+      break;
+    }
+    entry = this->logQueue[this->logHead];
+    this->logHead = (this->logHead + 1) % RTSP_LOG_QUEUE_SIZE;
+    dropped = this->logDropped;
+    this->logDropped = 0;
+    portEXIT_CRITICAL(&this->logMux);
+
+    if (!this->loggerCallback)
+    {
+      continue;
+    }
+    if (dropped > 0)
+    {
+      snprintf(this->logentry, sizeof(this->logentry), "RTSP log queue full; dropped %u entries", dropped);
+      this->loggerCallback(RTSP_LOG_LEVEL_WARN, this->logentry);
+    }
+    const uint32_t *a = entry.args;
+    if (entry.hasText)
+    {
+      snprintf(this->logentry, sizeof(this->logentry), entry.format, entry.text, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    else
+    {
+      snprintf(this->logentry, sizeof(this->logentry), entry.format, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    this->loggerCallback(entry.level, this->logentry);
   }
 }
 
 boolean AsyncRTSPServer::hasClients()
 {
-  return this->client != nullptr && this->client->getIsCurrentlyStreaming();
+  bool playing = false;
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->getIsCurrentlyStreaming()) {
+      playing = true;
+      break;
+    }
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+  return playing;
+}
+
+bool AsyncRTSPServer::isSendingFrame()
+{
+  return this->currentFrame.scanDataLength != 0;
 }
 
 void AsyncRTSPServer::pushFrame(uint8_t *data, size_t length, std::shared_ptr<void> image)
 {
+  if (this->httpServer != nullptr)
+  {
+    // HTTP consumers get the untouched JPEG; it only holds the frame if someone is waiting
+    this->httpServer->pushFrame(data, length, image);
+  }
+
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  this->frameRequestPending = false;
+
   // only decode the JPEG if we actually have clients connected.
   if (!this->hasClients())
   {
+    this->stats.framesIdle++;
+    xSemaphoreGiveRecursive(this->clientLock);
     return;
   }
 
-  if (!decodeJPEGfile(&data, &length, &this->currentFrame))
+  // decode aside, so a suppressed frame leaves the one being sent alone
+  DecodedJPEGFrame frame;
+  uint32_t jpegLength = length;
+  bool suppressing = this->sceneRefreshMillis != 0;
+  if (!decodeJPEGfile(&data, &jpegLength, &frame, suppressing ? &this->frameSignature : nullptr))
   {
-    this->loggerCallback("Cannot decode JPEG Data; freeing pointer");
+    RTSP_LOGW(this, "Cannot decode JPEG Data (%u bytes); freeing pointer", length);
     this->currentFrameSharedPointer = nullptr;
     this->currentFrame.scanDataLength  = 0;
+    this->bpr = {0, 0, false};
+    xSemaphoreGiveRecursive(this->clientLock);
     return;
   }
 
-  this->currentFrameSharedPointer = image;
   //printf("Pushing frame %u\n", millis());
   this->curMsec = millis();
   this->deltams = (this->curMsec >= this->prevMsec) ? this->curMsec - this->prevMsec : 100;
@@ -82,37 +230,149 @@ void AsyncRTSPServer::pushFrame(uint8_t *data, size_t length, std::shared_ptr<vo
   //printf("CHANGED TIMESTAMP FROM %u\n", this->m_Timestamp);
   this->m_Timestamp += (RTP_TIMESTAMP_HZ * deltams) / 1000; 
   //printf("CHANGED TIMESTAMP TO %u\n" , this->m_Timestamp);
-  
+
+  if (suppressing
+    && this->curMsec - this->lastFrameMillis < this->sceneRefreshMillis
+    && compareJPEGSignatures(&this->frameSignature, &this->sentSignature) <= this->sceneChangeThreshold)
+  {
+    // the clock above has already moved on, so the next frame we send carries the right timestamp
+    uint32_t playing = 0;
+    for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+      if (this->clients[i] != nullptr && this->clients[i]->getIsCurrentlyStreaming()) {
+        playing++;
+      }
+    }
+    this->stats.framesSuppressed++;
+    this->stats.bytesSuppressed += (uint64_t)jpegLength * playing;
+    xSemaphoreGiveRecursive(this->clientLock);
+    return;
+  }
+
+  if (this->currentFrame.scanDataLength != 0)
+  {
+    // the sender is behind; abandon the partially sent frame and start the new one from its first fragment
+    this->stats.framesReplaced++;
+    this->bpr = {0, 0, false};
+  }
+  this->currentFrame = frame;
+  this->currentFrameSharedPointer = image;
+  this->currentFrameTimestamp = this->m_Timestamp;
+  if (suppressing) {
+    this->currentSignature = this->frameSignature;
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+}
+
+/**
+ * Ask the frame source for the next frame if the pacer is idle and
+ * a playing client or an HTTP consumer is ready for it
+ */
+void AsyncRTSPServer::requestFrame()
+{
+  uint8_t fps = 0;
+  for (int i = 0; i < RTSP_MAX_CLIENTS; i++) {
+    if (this->clients[i] != nullptr && this->clients[i]->getIsCurrentlyStreaming()) {
+      fps = max(fps, this->clients[i]->getStats().frameRate);
+    }
+  }
+  if (this->httpServer != nullptr && this->httpServer->hasWaitingConsumers()) {
+    // a consumer still sending its last frame would only skip a new one, so
+    // only idle ones count; they are asked for no faster than the cap
+    fps = max(fps, this->maxFrameRate);
+  }
+  if (fps == 0) {
+    return; // nobody is playing or waiting
+  }
+
+  uint32_t sinceLastRequest = millis() - this->lastFrameRequestMillis;
+  if (this->frameRequestPending && sinceLastRequest < RTSP_FRAME_REQUEST_TIMEOUT_MS) {
+    return;
+  }
+  if (sinceLastRequest < 1000 / fps) {
+    return;
+  }
+  this->frameRequestPending = true;
+  this->lastFrameRequestMillis = millis();
+  this->stats.framesRequested++;
+  this->frameSourceCallback();
 }
 
 void AsyncRTSPServer::tick()
 {
+  // sessions may only disconnect (and be destroyed) between ticks
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  if (this->nackEnabled) {
+    this->handleRTCP();
+  }
+
+  if (this->frameSourceCallback && this->currentFrame.scanDataLength == 0) {
+    this->requestFrame();
+  }
+
   // send up to n packets per cpu tick
   for (int i = 0; i < 5; i++) {
     if (this->currentFrame.scanDataLength  == 0 ) {
       //this->loggerCallback("Skipping RTP PAcket prep");
-      return;
+      break;
     }
 
     if (this->hasClients() ) {
-      uint32_t s = millis();
+      uint32_t s = micros();
+      if (this->bpr.offset == 0) {
+        // only encode parity if someone receives it; decided per frame so groups stay aligned with frames
+        this->fecActive = false;
+        for (int c = 0; this->fec.getGroupSize() > 0 && c < RTSP_MAX_CLIENTS; c++) {
+          if (this->clients[c] != nullptr && this->clients[c]->getIsCurrentlyStreaming() && this->clients[c]->_FECPortInt != 0) {
+            this->fecActive = true;
+            break;
+          }
+        }
+      }
+      if (this->nackEnabled) {
+        // remember where this fragment came from in case a client asks for it again
+        RTPSentFragment *sent = &this->sentFragments[this->m_SequenceNumber % RTSP_NACK_HISTORY_SIZE];
+        *sent = {this->m_SequenceNumber, this->currentFrameTimestamp, (uint32_t)this->bpr.offset, true};
+      }
       PrepareRTPBufferForClients(
           this->RTPBuffer,
-          this->currentFrame.scanData,
-          this->currentFrame.scanDataLength,
+          &this->currentFrame,
           &this->bpr,
-          this->currentFrame.quant0tbl,
-          this->currentFrame.quant1tbl);
-      this->prepTime += millis() - s;
-      s = millis();
-      this->client->PushRTPBuffer(this->RTPBuffer, this->bpr.bufferSize);
-      this->sendTime += millis() - s;
+          this->m_SequenceNumber++,
+          this->currentFrameTimestamp);
+      if (this->fecActive && this->fec.getGroupSize() > 0) {
+        // fold the fragment into the parity while it is still in cache
+        this->fec.addPacket((uint8_t*)this->RTPBuffer + 4, this->bpr.bufferSize - 4);
+      }
+      this->stats.prepMicros += micros() - s;
+      s = micros();
+      for (int c = 0; c < RTSP_MAX_CLIENTS; c++) {
+        if (this->clients[c] != nullptr && this->clients[c]->getIsCurrentlyStreaming()) {
+          this->clients[c]->PushRTPBuffer(this->RTPBuffer, this->bpr.bufferSize, this->bpr.isLastFragment);
+        }
+      }
+      // close the group at the end of each frame so the parity arrives with the frame it protects
+      if (this->fecActive && this->fec.hasPendingPackets() && (this->fec.isGroupComplete() || this->bpr.isLastFragment)) {
+        size_t fecSize = this->fec.buildPacket(this->FECBuffer, sizeof(this->FECBuffer));
+        for (int c = 0; fecSize > 0 && c < RTSP_MAX_CLIENTS; c++) {
+          if (this->clients[c] != nullptr && this->clients[c]->getIsCurrentlyStreaming()) {
+            this->clients[c]->PushFECBuffer(this->FECBuffer, fecSize);
+          }
+        }
+      }
+      this->stats.sendMicros += micros() - s;
       if (this->bpr.isLastFragment) {
-        this->frameCount += 1;
+        this->stats.framesSent += 1;
         
         this->bpr = {0, 0, false};
         this->lastFrameMillis = millis();
+        this->sentSignature = this->currentSignature;
         this->frameFinishedCallback();
+        if (this->nackEnabled) {
+          // hold on to the frame until the next one is out, for retransmissions
+          this->retainedFrame = this->currentFrame;
+          this->retainedFrameTimestamp = this->currentFrameTimestamp;
+          this->retainedFrameSharedPointer = this->currentFrameSharedPointer;
+        }
         // free the buffer
         this->currentFrameSharedPointer = nullptr;
         this->currentFrame.scanDataLength  = 0;
@@ -123,20 +383,190 @@ void AsyncRTSPServer::tick()
       // free the buffer
       this->currentFrameSharedPointer = nullptr;
       this->currentFrame.scanDataLength  = 0;
+      this->retainedFrameSharedPointer = nullptr;
+      this->retainedFrame.scanDataLength = 0;
     }
   }
 
-    if (millis()%1000 == 0) {
-      // write stats once a second
-      sprintf(this->logentry, 
-        "RTSP server pushed frame %d\n  FPS: %f\n  Avg Prep Time: %f\n  Avg TXTime: %f", 
-        this->frameCount, 
-        (1.0/(((float)millis()-(float)this->lastFrameMillis)/1000)),
-        ((float)this->prepTime/(float)this->frameCount), 
-        ((float)this->sendTime/(float)this->frameCount)
+    if (millis() - this->lastStatsMillis >= 1000 && this->stats.framesSent > 0) {
+      // write stats once a second; fixed point since the entry is formatted later
+      this->lastStatsMillis = millis();
+      uint32_t sinceLastFrame = this->lastStatsMillis - this->lastFrameMillis;
+      RTSP_LOGI(this,
+        "RTSP server pushed frame %u\n  FPS: %u.%02u\n  Avg Prep Time: %u us\n  Avg TXTime: %u us",
+        this->stats.framesSent,
+        sinceLastFrame ? 1000 / sinceLastFrame : 0,
+        sinceLastFrame ? (100000 / sinceLastFrame) % 100 : 0,
+        (uint32_t)(this->stats.prepMicros / this->stats.framesSent),
+        (uint32_t)(this->stats.sendMicros / this->stats.framesSent)
       );
-      this->loggerCallback(logentry);
     }
+  xSemaphoreGiveRecursive(this->clientLock);
+}
+
+bool AsyncRTSPServer::getClientStats(int slot, RTSPClientStats *stats)
+{
+  if (slot < 0 || slot >= RTSP_MAX_CLIENTS)
+  {
+    return false;
+  }
+  xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+  bool used = this->clients[slot] != nullptr;
+  if (used)
+  {
+    *stats = this->clients[slot]->getStats();
+  }
+  xSemaphoreGiveRecursive(this->clientLock);
+  return used;
+}
+
+RTSPServerStats AsyncRTSPServer::getServerStats()
+{
+  return this->stats;
+}
+
+void AsyncRTSPServer::setFECGroupSize(uint8_t k)
+{
+  this->fec.setGroupSize(k);
+}
+
+uint8_t AsyncRTSPServer::getFECGroupSize()
+{
+  return this->fec.getGroupSize();
+}
+
+void AsyncRTSPServer::setNACKEnabled(bool enabled)
+{
+  this->nackEnabled = enabled;
+  if (!enabled)
+  {
+    this->retainedFrameSharedPointer = nullptr;
+    this->retainedFrame.scanDataLength = 0;
+  }
+}
+
+bool AsyncRTSPServer::getNACKEnabled()
+{
+  return this->nackEnabled;
+}
+
+void AsyncRTSPServer::setHTTPServer(AsyncMJPEGServer *server)
+{
+  this->httpServer = server;
+}
+
+void AsyncRTSPServer::setSceneSuppression(uint32_t refreshMillis, uint8_t changeThresholdPercent)
+{
+  this->sceneRefreshMillis = refreshMillis;
+  this->sceneChangeThreshold = min(changeThresholdPercent, (uint8_t)100);
+  this->refreshScene();
+}
+
+void AsyncRTSPServer::refreshScene()
+{
+  this->sentSignature.bucketCount = 0;
+  this->currentSignature.bucketCount = 0;
+}
+
+/**
+ * Drain the RTCP socket and act on any generic NACKs
+ * https://datatracker.ietf.org/doc/html/rfc4585#section-6.2.1
+ */
+void AsyncRTSPServer::handleRTCP()
+{
+  int size;
+  while ((size = this->rtcpUdp.parsePacket()) > 0)
+  {
+    IPAddress ip = this->rtcpUdp.remoteIP();
+    uint16_t port = this->rtcpUdp.remotePort();
+    size = this->rtcpUdp.read(this->rtcpBuffer, sizeof(this->rtcpBuffer));
+
+    AsyncRTSPClient *client = nullptr;
+    for (int c = 0; c < RTSP_MAX_CLIENTS; c++) {
+      if (this->clients[c] != nullptr && this->clients[c]->isRTCPSource(ip, port)) {
+        client = this->clients[c];
+        break;
+      }
+    }
+    if (client == nullptr || size <= 0)
+    {
+      continue;
+    }
+
+    // walk the compound packet: V(2) P(1) FMT(5) PT(8) length(16) in 32 bit words minus one
+    int pos = 0;
+    while (pos + 4 <= size)
+    {
+      uint8_t *rtcp = this->rtcpBuffer + pos;
+      uint8_t fmt = rtcp[0] & 0x1F;
+      uint8_t pt = rtcp[1];
+      int length = ((rtcp[2] << 8) | rtcp[3]) * 4 + 4;
+      if ((rtcp[0] & 0xC0) != 0x80 || pos + length > size)
+      {
+        break;
+      }
+      // RTPFB (205) with FMT 1 is a generic NACK; FCI entries of PID(16) BLP(16) follow the two SSRCs
+      if (pt == 205 && fmt == 1 && length >= 12)
+      {
+        for (int fci = 12; fci + 4 <= length; fci += 4)
+        {
+          uint16_t pid = (rtcp[fci] << 8) | rtcp[fci + 1];
+          uint16_t blp = (rtcp[fci + 2] << 8) | rtcp[fci + 3];
+          this->handleNACK(client, pid);
+          for (int bit = 0; bit < 16; bit++) {
+            if (blp & (1 << bit)) {
+              this->handleNACK(client, pid + bit + 1);
+            }
+          }
+        }
+      }
+      pos += length;
+    }
+  }
+}
+
+void AsyncRTSPServer::handleNACK(AsyncRTSPClient *client, uint16_t sequenceNumber)
+{
+  client->_stats.nacksReceived++;
+
+  const RTPSentFragment *sent = &this->sentFragments[sequenceNumber % RTSP_NACK_HISTORY_SIZE];
+  const DecodedJPEGFrame *frame = nullptr;
+  if (sent->valid && sent->sequenceNumber == sequenceNumber)
+  {
+    if (this->currentFrame.scanDataLength != 0 && sent->timestamp == this->currentFrameTimestamp)
+    {
+      frame = &this->currentFrame;
+    }
+    else if (this->retainedFrame.scanDataLength != 0 && sent->timestamp == this->retainedFrameTimestamp)
+    {
+      frame = &this->retainedFrame;
+    }
+  }
+  if (frame == nullptr || sent->offset >= frame->scanDataLength)
+  {
+    client->_stats.nacksExpired++;
+    return;
+  }
+
+  if (millis() - this->retransmitWindowMillis >= 1000)
+  {
+    this->retransmitWindowMillis = millis();
+    this->retransmitsInWindow = 0;
+  }
+  if (this->retransmitsInWindow >= RTSP_NACK_MAX_RETRANSMITS_PER_SECOND)
+  {
+    client->_stats.nacksRateLimited++;
+    return;
+  }
+  this->retransmitsInWindow++;
+
+  // rebuild the identical packet from the frame; tick() prepares its next fragment from scratch
+  RTPBuffferPreparationResult resend = {(int)sent->offset, 0, false};
+  PrepareRTPBufferForClients(this->RTPBuffer, frame, &resend, sent->sequenceNumber, sent->timestamp);
+  if (client->sendUDPPacket(this->RTPBuffer, resend.bufferSize, client->_RTPPortInt, true))
+  {
+    client->_stats.nacksServed++;
+  }
 }
 
 void AsyncRTSPServer::onClient(RTSPConnectHandler callback, void *that)
@@ -150,6 +580,21 @@ void AsyncRTSPServer::onFrameFinished( std::function<void ()> callback, void *th
   this->that = that;
 }
 
+void AsyncRTSPServer::setFrameSource(std::function<void ()> callback, void *that) {
+  this->frameSourceCallback = callback;
+  this->thatsource = that;
+}
+
+void AsyncRTSPServer::setMaxFrameRate(uint8_t fps)
+{
+  this->maxFrameRate = max(fps, (uint8_t)1);
+}
+
+uint8_t AsyncRTSPServer::getMaxFrameRate()
+{
+  return this->maxFrameRate;
+}
+
 void AsyncRTSPServer::setLogFunction(LogFunction callback, void *that)
 {
   this->loggerCallback = callback;
@@ -168,11 +613,10 @@ int AsyncRTSPServer::GetRTCPServerPort()
 
 void AsyncRTSPServer::PrepareRTPBufferForClients(
     char *RtpBuf,
-    uint8_t *data,
-    int length,
+    const DecodedJPEGFrame *frame,
     RTPBuffferPreparationResult *bpr,
-    unsigned const char *quant0tbl,
-    unsigned const char *quant1tbl)
+    u_short sequenceNumber,
+    uint32_t timestamp)
 {
 
 #define KRtpHeaderSize 12 // size of the RTP header
@@ -187,21 +631,28 @@ void AsyncRTSPServer::PrepareRTPBufferForClients(
  * and the client
  */
 #define MAX_FRAGMENT_SIZE 1300 
+#define KRestartHeaderSize 4 // RFC 2435 section 3.1.7 restart marker header
+  static_assert(4 + KRtpHeaderSize + KJpegHeaderSize + KRestartHeaderSize + 4 + 2 * 128 + MAX_FRAGMENT_SIZE <= RTSP_MAX_PACKET_SIZE,
+    "RTSP_MAX_PACKET_SIZE is too small for a full fragment with quant tables");
+  int length = frame->scanDataLength; // the scan data excludes the JPEG end marker (FFD9)
   int fragmentLen = MAX_FRAGMENT_SIZE;
   if (fragmentLen + bpr->offset >= length)
-  {                                         // Shrink last fragment if needed
-    fragmentLen = length - bpr->offset - 2; // the JPEG end marker (FFD9) will be in this fragment.  drop it from the end
+  { // Shrink last fragment if needed
+    fragmentLen = length - bpr->offset;
     bpr->isLastFragment = true;
   }
 
   // Do we have custom quant tables? If so include them per RFC
+  // (the q value is always >= 128 when they are present in the image)
+  bool hasQuantTbl = frame->quant0tbl && frame->quant1tbl;
+  bool includeQuantTbl = hasQuantTbl && bpr->offset == 0;
+  uint8_t q = hasQuantTbl ? 128 : 0x5e;
+  bool includeRestartHeader = frame->type & RTP_JPEG_TYPE_RESTART_FLAG;
 
-  bool includeQuantTbl = quant0tbl && quant1tbl && bpr->offset == 0;
-  uint8_t q = includeQuantTbl ? 128 : 0x5e;
-
-  bpr->bufferSize = 4 + fragmentLen + KRtpHeaderSize + KJpegHeaderSize + (includeQuantTbl ? (4 + 64 * 2) : 0);
+  bpr->bufferSize = 4 + fragmentLen + KRtpHeaderSize + KJpegHeaderSize 
+    + (includeRestartHeader ? KRestartHeaderSize : 0)
+    + (includeQuantTbl ? (4 + frame->quantLength) : 0);
 
-  memset(RtpBuf, 0x00, sizeof(RtpBuf));
   // Prepare the first 4 byte of the packet. This is the Rtp over Rtsp header in case of TCP based transport
   RtpBuf[0] = '$'; // magic number
   RtpBuf[1] = 0;   // number of multiplexed subchannel on RTPS connection - here the RTP channel
@@ -210,12 +661,12 @@ void AsyncRTSPServer::PrepareRTPBufferForClients(
   // Prepare the 12 byte RTP header
   RtpBuf[4] = 0x80;                                       // RTP version
   RtpBuf[5] = 0x1a | (bpr->isLastFragment ? 0x80 : 0x00); // JPEG payload (26) and marker bit
-  RtpBuf[7] = m_SequenceNumber & 0x0FF;                   // each packet is counted with a sequence counter
-  RtpBuf[6] = m_SequenceNumber >> 8;
-  RtpBuf[8] = (this->m_Timestamp & 0xFF000000) >> 24; // each image gets a timestamp
-  RtpBuf[9] = (this->m_Timestamp & 0x00FF0000) >> 16;
-  RtpBuf[10] = (this->m_Timestamp & 0x0000FF00) >> 8;
-  RtpBuf[11] = (this->m_Timestamp & 0x000000FF);
+  RtpBuf[7] = sequenceNumber & 0x0FF;                     // each packet is counted with a sequence counter
+  RtpBuf[6] = sequenceNumber >> 8;
+  RtpBuf[8] = (timestamp & 0xFF000000) >> 24; // each image gets a timestamp
+  RtpBuf[9] = (timestamp & 0x00FF0000) >> 16;
+  RtpBuf[10] = (timestamp & 0x0000FF00) >> 8;
+  RtpBuf[11] = (timestamp & 0x000000FF);
   RtpBuf[12] = 0x13; // 4 byte SSRC (sychronization source identifier)
   RtpBuf[13] = 0xf9; // we just an arbitrary number here to keep it simple
   RtpBuf[14] = 0x7e;
@@ -231,39 +682,64 @@ void AsyncRTSPServer::PrepareRTPBufferForClients(
        type 0 video is downsampled horizontally by 2 (often called 4:2:2)
        while the chrominance components of type 1 video are downsampled both
        horizontally and vertically by 2 (often called 4:2:0). */
-  RtpBuf[20] = 0x00;                  // type (fixme might be wrong for camera data) https://tools.ietf.org/html/rfc2435
+  RtpBuf[20] = frame->type;           // type, taken from the SOF0 sampling factors https://tools.ietf.org/html/rfc2435
   RtpBuf[21] = q;                     // quality scale factor was 0x5e
-  RtpBuf[22] = this->_dim.width / 8;  // width  / 8
-  RtpBuf[23] = this->_dim.height / 8; // height / 8
+  RtpBuf[22] = frame->width / 8;      // width  / 8
+  RtpBuf[23] = frame->height / 8;     // height / 8
 
   int headerLen = 24; // Inlcuding jpeg header but not qant table header
+  if (includeRestartHeader)
+  { // every packet carries the restart marker header when the type is 64-127
+    RtpBuf[24] = (frame->restartInterval & 0xFF00) >> 8;
+    RtpBuf[25] = (frame->restartInterval & 0x00FF);
+    // F=1, L=1, Restart Count=0x3FFF: our fragments don't fall on restart boundaries
+    RtpBuf[26] = 0xFF;
+    RtpBuf[27] = 0xFF;
+    headerLen += KRestartHeaderSize;
+  }
+
   if (includeQuantTbl)
   {                 // we need a quant header - but only in first packet of the frame
-    RtpBuf[24] = 0; // MBZ
-    RtpBuf[25] = 0; // 8 bit precision
-    RtpBuf[26] = 0; // MSB of lentgh
-
-    int numQantBytes = 64;         // Two 64 byte tables
-    RtpBuf[27] = 2 * numQantBytes; // LSB of length
+    int luma = (frame->quantPrecision & 0x01) ? 128 : 64;
+    int chroma = (frame->quantPrecision & 0x02) ? 128 : 64;
+    RtpBuf[headerLen] = 0;                                             // MBZ
+    RtpBuf[headerLen + 1] = frame->quantPrecision;                     // bit set per 16 bit table
+    RtpBuf[headerLen + 2] = (frame->quantLength & 0xFF00) >> 8;        // MSB of lentgh
+    RtpBuf[headerLen + 3] = (frame->quantLength & 0x00FF);             // LSB of length
 
     headerLen += 4;
 
-    memcpy(RtpBuf + headerLen, quant0tbl, numQantBytes);
-    headerLen += numQantBytes;
+    memcpy(RtpBuf + headerLen, frame->quant0tbl, luma);
+    headerLen += luma;
 
-    memcpy(RtpBuf + headerLen, quant1tbl, numQantBytes);
-    headerLen += numQantBytes;
+    memcpy(RtpBuf + headerLen, frame->quant1tbl, chroma);
+    headerLen += chroma;
   }
 
   // append the JPEG scan data to the RTP buffer
-  memcpy(RtpBuf + headerLen, data + bpr->offset, fragmentLen);
+  memcpy(RtpBuf + headerLen, frame->scanData + bpr->offset, fragmentLen);
   bpr->offset += fragmentLen;
-
-  m_SequenceNumber++; // prepare the packet counter for the next packet
 }
 
 void AsyncRTSPServer::begin()
 {
   _server.setNoDelay(true);
   _server.begin();
+  this->rtpUdp.begin(this->RtpServerPort);
+  this->rtcpUdp.begin(this->RtcpServerPort);
+#ifdef WIFIUDP_HAS_DROP_HANDLER
+  // this backend queues datagrams, so endPacket() can't fail the ones the kernel drops later
+  this->rtpUdp.onDrop([this](IPAddress ip, uint16_t port, const uint8_t* packet, size_t length, uint8_t retransmission) {
+    xSemaphoreTakeRecursive(this->clientLock, portMAX_DELAY);
+    for (int c = 0; c < RTSP_MAX_CLIENTS; c++) {
+      AsyncRTSPClient* client = this->clients[c];
+      if (client != nullptr && client->_tcp_client->remoteIP() == ip
+        && (port == client->_RTPPortInt || port == client->_FECPortInt)) {
+        client->packetDropped(packet, length, retransmission);
+        break;
+      }
+    }
+    xSemaphoreGiveRecursive(this->clientLock);
+  });
+#endif
 }
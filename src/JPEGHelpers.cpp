@@ -1,168 +1,328 @@
 // References:
 // https://www.fileformat.info/format/jpeg/egff.htm
 // https://www.videotechnology.com/jpeg/j1.html
+// https://www.w3.org/Graphics/JPEG/itu-t81.pdf (Annex B - compressed data formats)
 
 #include <Arduino.h>
 #include "JPEGHelpers.h"
 
 // most of the JPEG headers contain two bytes after the marker
 // specifying the length of the header (including these length bits)
-// this function moves the supplied pointer PAST the currently
-// pointed-at header using this length description
-// NOTE: not necessarily safe for all header types; use wisely.
-void nextJpegBlock(BufPtr* bytes) {
-    uint32_t len = (*bytes)[0] * 256 + (*bytes)[1];
-    *bytes += len;
+static inline uint16_t readJpegUint16(const unsigned char* bytes) {
+    return bytes[0] * 256 + bytes[1];
 }
 
-// TODO: Replace this function with one that returns a struct containing the details of the 
-// header it just found (including things like length, code, etc) so that
-// we can remove duplicate logic later on (for things like figuring out the length of the SOS markers)
+// markers that are not followed by a length field
+static inline bool isStandaloneMarker(uint8_t marker) {
+    return marker == JEPG_StartOfImage
+        || marker == JPEG_EndOfImage
+        || marker == 0x01 // TEM
+        || (marker >= JPEG_Restart0 && marker <= JPEG_Restart7);
+}
 
-// search for a particular JPEG marker, moves *start to just after that marker
-// This function fixes up the provided start ptr to point to the
-// actual JPEG stream data and returns the number of bytes skipped
+static void recordJpegSegment(DecodedJPEGFrame* frame, uint8_t marker, uint32_t offset, uint16_t length) {
+    if (frame->segmentCount >= JPEG_MAX_SEGMENTS) {
+        return; // the index is informational; keep parsing even if we run out of slots
+    }
+    frame->segments[frame->segmentCount++] = {marker, offset, length};
+}
 
-// AHHHAHHHHHH - BufPtr (which I replaced with unsigned char *) was used as a pointer-to-a-pointer here
-// So this is not actually modifying the incoming pointer
-bool findJPEGheader(BufPtr* start, uint32_t *len, char marker) {
+/**
+ * Walk the JPEG once, front to back, and fill in the frame descriptor:
+ * every segment offset, the frame dimensions and chroma subsampling from
+ * SOF0/SOF1, all quant tables (including multi-table DQT segments and 16 bit
+ * precision), the restart interval from DRI, and the bounds of the scan data.
+ * Images wider or taller than RTP_JPEG_MAX_DIMENSION can't be described in
+ * the RTP/JPEG header and are rejected.
+ *
+ * Every read is checked against len, so a truncated or corrupt camera
+ * buffer returns false instead of walking off the end of the buffer.
+ */
+bool indexJPEGFrame(unsigned char* bytes, uint32_t len, DecodedJPEGFrame* frame) {
+    *frame = {};
 
-    // per https://en.wikipedia.org/wiki/JPEG_File_Interchange_Format
-    BufPtr bytes = *start;
+    unsigned char* quantTables[JPEG_MAX_QUANT_TABLES] = {};
+    bool quantIs16Bit[JPEG_MAX_QUANT_TABLES] = {};
+    uint8_t componentCount = 0;
+    uint8_t componentSampling[3] = {};
+    uint8_t componentQuantTable[3] = {};
+    bool haveFrameHeader = false;
 
-    // kinda skanky, will break if unlucky and the headers inxlucde 0xffda
-    // might fall off array if jpeg is invalid
-    // FIXME - return false instead
-    while(bytes - *start < *len) {
+    if (len < 4 || bytes[0] != 0xff || bytes[1] != JEPG_StartOfImage) {
+        return false; // better at least look like a jpeg file
+    }
+    recordJpegSegment(frame, JEPG_StartOfImage, 0, 0);
 
-        char framing = *bytes++; // better be 0xff since all of the JPEG_ header codes start with 0xff
-        if(framing != 0xff) {
-            //printf("malformed jpeg, framing=%x %p\n", framing, bytes);
+    uint32_t pos = 2;
+    while (true) {
+        if (pos + 2 > len || bytes[pos] != 0xff) {
+            return false; // malformed; every segment must start with 0xff
+        }
+        // any number of 0xff fill bytes may precede a marker
+        while (pos + 1 < len && bytes[pos + 1] == 0xff) {
+            pos++;
+        }
+        if (pos + 2 > len) {
             return false;
         }
+        uint32_t markerOffset = pos;
+        uint8_t marker = bytes[pos + 1];
+        pos += 2;
 
-        char typecode = *bytes++;
-        if(typecode == marker) {
-            char skipped = bytes - *start;
-            //printf("found marker 0x%x at %p, skipped %d\n", marker, bytes, skipped);
-
-            *start = bytes;
+        if (isStandaloneMarker(marker)) {
+            recordJpegSegment(frame, marker, markerOffset, 0);
+            if (marker == JPEG_EndOfImage) {
+                return false; // EOI before any scan
+            }
+            continue;
+        }
 
-            // shrink len for the bytes we just skipped
-            *len -= skipped;
+        if (pos + 2 > len) {
+            return false;
+        }
+        uint16_t segmentLength = readJpegUint16(bytes + pos);
+        if (segmentLength < 2 || pos + segmentLength > len) {
+            return false;
+        }
+        recordJpegSegment(frame, marker, markerOffset, segmentLength);
+        unsigned char* payload = bytes + pos + 2;
+        uint32_t payloadLength = segmentLength - 2;
 
-            return true;
+        switch (marker) {
+        case JPEG_DefineQuantizationTable:
+        {
+            // a single DQT segment may carry several tables back to back
+            uint32_t p = 0;
+            while (p < payloadLength) {
+                uint8_t precision = payload[p] >> 4;
+                uint8_t tableId = payload[p] & 0x0f;
+                uint32_t tableLength = precision ? 128 : 64;
+                if (tableId >= JPEG_MAX_QUANT_TABLES || p + 1 + tableLength > payloadLength) {
+                    return false;
+                }
+                quantTables[tableId] = payload + p + 1;
+                quantIs16Bit[tableId] = precision != 0;
+                p += 1 + tableLength;
+            }
+            break;
+        }
+        case JPEG_StartBaselineDCTFrame:
+        case JPEG_StartExtendedDCTFrame:
+        {
+            // P(1) Y(2) X(2) Nf(1) then Nf * { C(1) HV(1) Tq(1) }
+            if (payloadLength < 6) {
+                return false;
+            }
+            frame->height = readJpegUint16(payload + 1);
+            frame->width = readJpegUint16(payload + 3);
+            if (frame->width > RTP_JPEG_MAX_DIMENSION || frame->height > RTP_JPEG_MAX_DIMENSION) {
+                return false;
+            }
+            componentCount = payload[5];
+            if (payloadLength < 6 + 3 * (uint32_t)componentCount) {
+                return false;
+            }
+            for (uint8_t c = 0; c < componentCount && c < 3; c++) {
+                componentSampling[c] = payload[6 + 3 * c + 1];
+                componentQuantTable[c] = payload[6 + 3 * c + 2];
+                if (componentQuantTable[c] >= JPEG_MAX_QUANT_TABLES) {
+                    return false;
+                }
+            }
+            haveFrameHeader = true;
+            break;
         }
-        else {
-            // not the section we were looking for, skip the entire section
-            switch(typecode) {
-            case JEPG_StartOfImage:     // start of image
-            {
-                break;   // no data to skip
+        case JPEG_StartProgressiveDCTFrame:
+            return false; // RFC 2435 only carries baseline DCT images
+        case JPEG_DefineRestartInterval:
+        {
+            if (payloadLength < 2) {
+                return false;
             }
-            // All of these JPEG headers contain two bytes following the marker
-            // specifying the length of the segment
-            // Use that defined length to skip the whole segment
-            // and advance the bytes pointer to the next segment
-            case JPEG_APP_0:   // app0
-            case JPEG_DefineQuantizationTable:   // dqt
-            case JPEG_DefineHuffmanTable:   // dht
-            case JPEG_StartBaselineDCTFrame:   // sof0
-            case JPEG_StartOfScan:   // sos
-            {
-                nextJpegBlock(&bytes);
-                break;
+            frame->restartInterval = readJpegUint16(payload);
+            break;
+        }
+        case JPEG_StartOfScan:
+        {
+            // the scan data uses byte stuffing to guarantee anything that starts with 0xff
+            // followed by something other than zero or a restart marker is a new section.
+            uint32_t scanStart = pos + segmentLength;
+            uint32_t end = scanStart;
+            while (end + 1 < len) {
+                if (bytes[end] == 0xff && bytes[end + 1] != 0x00
+                    && !(bytes[end + 1] >= JPEG_Restart0 && bytes[end + 1] <= JPEG_Restart7)
+                    && bytes[end + 1] != 0xff) {
+                    break;
+                }
+                end++;
             }
-            default:
-                //printf("unexpected jpeg typecode 0x%x\n", typecode);
-                break;
+            if (end + 1 >= len || bytes[end + 1] != JPEG_EndOfImage) {
+                return false; // we only support a single scan terminated by EOI
             }
+            recordJpegSegment(frame, JPEG_EndOfImage, end, 0);
+
+            frame->scanData = bytes + scanStart;
+            frame->scanDataLength = end - scanStart;
+            frame->jpegData = bytes;
+            frame->jpegLength = end + 2;
+            break;
+        }
+        default:
+            break; // APPn, COM, DHT etc. are recorded but otherwise not needed
+        }
+
+        if (frame->scanData != nullptr) {
+            break;
         }
+        pos += segmentLength;
     }
 
-    //printf("failed to find jpeg marker 0x%x", marker);
-    return false;
-}
+    if (!haveFrameHeader || componentCount != 3) {
+        return false; // grayscale and CMYK images can't be described by RFC 2435
+    }
 
-// the scan data uses byte stuffing to guarantee anything that starts with 0xff
-// followed by something not zero, is a new section.  Look for that marker and return the ptr
-// pointing there
-void skipScanBytes(BufPtr* start, uint32_t len) {
-    unsigned char* bytes = *start;
-
-    while(bytes - *start < len) {
-        while(*bytes++ != 0xff);
-        if(*bytes++ == 0xd9) {
-            *start = bytes - 2; // back up to the 0xff marker we just found
-            return;
-        }
+    // RFC 2435 section 4.1: chroma components must be 1x1, luma is 2x1 for type 0 and 2x2 for type 1
+    if (componentSampling[1] != 0x11 || componentSampling[2] != 0x11) {
+        return false;
+    }
+    if (componentSampling[0] == 0x21) {
+        frame->type = RTP_JPEG_TYPE_422;
+    }
+    else if (componentSampling[0] == 0x22) {
+        frame->type = RTP_JPEG_TYPE_420;
+    }
+    else {
+        return false;
+    }
+    if (frame->restartInterval != 0) {
+        frame->type += RTP_JPEG_TYPE_RESTART_FLAG;
+    }
+
+    // the chroma components share a table in RFC 2435, so use whatever the Cb component references
+    frame->quant0tbl = quantTables[componentQuantTable[0]];
+    frame->quant1tbl = quantTables[componentQuantTable[1]];
+    if (frame->quant0tbl && frame->quant1tbl) {
+        bool luma16 = quantIs16Bit[componentQuantTable[0]];
+        bool chroma16 = quantIs16Bit[componentQuantTable[1]];
+        frame->quantPrecision = (luma16 ? 0x01 : 0x00) | (chroma16 ? 0x02 : 0x00);
+        frame->quantLength = (luma16 ? 128 : 64) + (chroma16 ? 128 : 64);
+    }
+    else {
+        frame->quant0tbl = nullptr;
+        frame->quant1tbl = nullptr;
     }
-    //printf("could not find end of scan");
-}
 
+    return true;
+}
 
 /**
  * Decode the incoming JPEG file bytes by locating the various portions
  * of the file (quantization tables, various headers, and scan bytes)
- * 
+ *
  * Update the strcut at the location of the provided currentFrame pointer
  * to include a reference to the original shared_ptr from the DMA transfer of the camera frame
  * as well as the memory addresses of the two quantization tables and the JPEG scan data.
- * 
- */ 
-bool decodeJPEGfile(BufPtr* start, uint32_t* len, DecodedJPEGFrame* currentFrame) {
-    // per https://en.wikipedia.org/wiki/JPEG_File_Interchange_Format
-    unsigned char *bytes = *start;
-
-    // move the start pointer to the beginning of the image (marker FFD8); fail if we can't.
-    // Updates len to the number of bytes remaining in the buffer
-    if(!findJPEGheader(&bytes, len, JEPG_StartOfImage)) // better at least look like a jpeg file
+ *
+ * On success *start points at the scan data and *len is the number of scan bytes
+ * (the trailing EOI marker is not included).
+ */
+bool decodeJPEGfile(BufPtr* start, uint32_t* len, DecodedJPEGFrame* currentFrame, JPEGSceneSignature* signature) {
+    if (!indexJPEGFrame(*start, *len, currentFrame)) {
+        currentFrame->scanDataLength = 0;
         return false; // FAILED!
-
-    // Look for quant tables if they are present
-    currentFrame->quant0tbl = nullptr;
-    currentFrame->quant1tbl = nullptr;
-    BufPtr quantstart = *start;
-    uint32_t quantlen = *len;
-    // using the start pointer as a base, move the quantstart pointer to where quant tables
-    // begin (marker FFDB)
-    if(!findJPEGheader(&quantstart, &quantlen, JPEG_DefineQuantizationTable)) {
-        //printf("error can't find quant table 0\n");
     }
-    else {
-        currentFrame->quant0tbl = quantstart + 3;
-        nextJpegBlock(&quantstart);
-        if(!findJPEGheader(&quantstart, &quantlen, JPEG_DefineQuantizationTable)) {
-            //printf("error can't find quant table 1\n");
-        }
-        currentFrame->quant1tbl = quantstart + 3;
-        nextJpegBlock(&quantstart);
+    if (signature != nullptr) {
+        signJPEGFrame(currentFrame, signature);
     }
 
-    // move the start pointer (which was passed to this function) to the address of the start of
-    // scan data (marker FFDA))
-    if(!findJPEGheader(start, len, JPEG_StartOfScan))
-        return false; // FAILED!
+    *start = currentFrame->scanData;
+    *len = currentFrame->scanDataLength;
+    return true;
+}
 
-    // Skip the header bytes of the SOS marker
-    uint32_t soslen = (*start)[0] * 256 + (*start)[1];
-    *start += soslen;
-    *len -= soslen;
-
-    // start scanning the data portion of the scan to find the end marker
-    BufPtr endmarkerptr = *start;
-    uint32_t endlen = *len;
-   
-    skipScanBytes(&endmarkerptr, *len);
-    if(!findJPEGheader(&endmarkerptr, &endlen, JPEG_EndOfImage))
-        return false; // FAILED!
+// 32 bit FNV-1a, a word at a time for the scan data; every step is a bijection
+// of the state, so a single changed word always changes the result
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static inline uint32_t fnv1a(uint32_t hash, const unsigned char* bytes, uint32_t len) {
+    uint32_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word;
+        memcpy(&word, bytes + i, 4);
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
 
-    // endlen must now be the # of bytes between the start of our scan and
-    // the end marker, tell the caller to ignore bytes afterwards
-    *len = endmarkerptr - *start;
+/**
+ * Fingerprint the frame's scan data.  Restart intervals are hashed separately
+ * and spread evenly over the buckets, so the hash of each bucket depends only
+ * on the MCUs it covers, not on the bytes before it.
+ */
+void signJPEGFrame(const DecodedJPEGFrame* frame, JPEGSceneSignature* signature) {
+    uint32_t header = FNV_OFFSET_BASIS;
+    uint8_t fields[5] = {
+        (uint8_t)(frame->width >> 8), (uint8_t)frame->width,
+        (uint8_t)(frame->height >> 8), (uint8_t)frame->height,
+        frame->type };
+    header = fnv1a(header, fields, sizeof(fields));
+    if (frame->quant0tbl != nullptr) {
+        // the two tables are not necessarily adjacent; each is 64 or 128 bytes
+        uint32_t lumaLength = (frame->quantPrecision & 0x01) ? 128 : 64;
+        header = fnv1a(header, frame->quant0tbl, lumaLength);
+        header = fnv1a(header, frame->quant1tbl, frame->quantLength - lumaLength);
+    }
+    signature->headerHash = header;
 
-    currentFrame->scanDataLength = *len;
-    currentFrame->scanData = *start;
+    // how many restart intervals the image is split into; RFC 2435 types only use 16 pixel wide MCUs
+    uint32_t intervals = 1;
+    if (frame->restartInterval != 0) {
+        uint32_t mcuHeight = ((frame->type & ~RTP_JPEG_TYPE_RESTART_FLAG) == RTP_JPEG_TYPE_420) ? 16 : 8;
+        uint32_t mcus = ((frame->width + 15) / 16) * ((frame->height + mcuHeight - 1) / mcuHeight);
+        intervals = max((mcus + frame->restartInterval - 1) / frame->restartInterval, (uint32_t)1);
+    }
+    signature->bucketCount = min(intervals, (uint32_t)JPEG_SCENE_BUCKETS);
+    for (int b = 0; b < signature->bucketCount; b++) {
+        signature->buckets[b] = FNV_OFFSET_BASIS;
+    }
 
-    return true;
+    const unsigned char* scan = frame->scanData;
+    uint32_t segmentStart = 0;
+    uint32_t interval = 0;
+    uint32_t i = 0;
+    while (frame->restartInterval != 0 && i + 1 < frame->scanDataLength) {
+        const unsigned char* ff = (const unsigned char*)memchr(scan + i, 0xff, frame->scanDataLength - 1 - i);
+        if (ff == nullptr) {
+            break;
+        }
+        i = ff - scan;
+        if (scan[i + 1] < JPEG_Restart0 || scan[i + 1] > JPEG_Restart7) {
+            i++;
+            continue;
+        }
+        uint32_t bucket = min(interval * signature->bucketCount / intervals, (uint32_t)signature->bucketCount - 1);
+        signature->buckets[bucket] = fnv1a(signature->buckets[bucket], scan + segmentStart, i - segmentStart);
+        interval++;
+        i += 2;
+        segmentStart = i;
+    }
+    uint32_t bucket = min(interval * signature->bucketCount / intervals, (uint32_t)signature->bucketCount - 1);
+    signature->buckets[bucket] = fnv1a(signature->buckets[bucket], scan + segmentStart, frame->scanDataLength - segmentStart);
+}
+
+uint8_t compareJPEGSignatures(const JPEGSceneSignature* a, const JPEGSceneSignature* b) {
+    if (a->bucketCount == 0 || a->bucketCount != b->bucketCount || a->headerHash != b->headerHash) {
+        return 100;
+    }
+    uint32_t changed = 0;
+    for (int i = 0; i < a->bucketCount; i++) {
+        if (a->buckets[i] != b->buckets[i]) {
+            changed++;
+        }
+    }
+    return changed * 100 / a->bucketCount;
 }
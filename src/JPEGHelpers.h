@@ -5,15 +5,76 @@
 #define JPEG_APP_0 0xe0
 #define JPEG_DefineQuantizationTable 0xdb
 #define JPEG_DefineHuffmanTable 0xc4
+#define JPEG_DefineRestartInterval 0xdd
 #define JPEG_StartOfScan 0xda
 #define JPEG_StartBaselineDCTFrame 0xc0
+#define JPEG_StartExtendedDCTFrame 0xc1
+#define JPEG_StartProgressiveDCTFrame 0xc2
+#define JPEG_Restart0 0xd0
+#define JPEG_Restart7 0xd7
 #define JPEG_EndOfImage 0xd9
 
+// RFC 2435 section 3.1.3 types; the restart variants add 64
+#define RTP_JPEG_TYPE_422 0
+#define RTP_JPEG_TYPE_420 1
+#define RTP_JPEG_TYPE_RESTART_FLAG 64
+// RFC 2435 section 3.1.5/3.1.6 send width and height / 8 in one byte each
+#define RTP_JPEG_MAX_DIMENSION 2040
+
+#define JPEG_MAX_SEGMENTS 16
+#define JPEG_MAX_QUANT_TABLES 4
+#define JPEG_SCENE_BUCKETS 64
+
 typedef unsigned char* BufPtr;
 
+/**
+ * Location of a single marker segment within the JPEG buffer
+ */
+struct JPEGSegment {
+  uint8_t marker;
+  uint32_t offset; // offset of the 0xFF byte of the marker from the start of the image
+  uint16_t length; // segment length including the two length bytes; 0 for standalone markers
+};
+
+/**
+ * Everything the RTP packetizer needs to know about a frame, collected
+ * in a single pass over the JPEG headers by indexJPEGFrame()
+ */
 struct DecodedJPEGFrame {
-  unsigned char * quant0tbl;
-  unsigned char * quant1tbl;
-  unsigned char * scanData;
+  unsigned char * quant0tbl; // quant table used by the luma component
+  unsigned char * quant1tbl; // quant table used by the chroma components
+  unsigned char * scanData;  // entropy coded data, excluding the EOI marker
   uint32_t scanDataLength;
-};
\ No newline at end of file
+  unsigned char * jpegData;  // the complete image from SOI through EOI
+  uint32_t jpegLength;
+  uint16_t width;
+  uint16_t height;
+  uint8_t type;              // RFC 2435 type (0 = 4:2:2, 1 = 4:2:0), +64 when restart markers are used
+  uint16_t restartInterval;  // MCUs between restart markers; 0 when there is no DRI segment
+  uint8_t quantPrecision;    // RFC 2435 Q header precision; bit 0 luma, bit 1 chroma set when 16 bit
+  uint16_t quantLength;      // total bytes of quant0tbl + quant1tbl
+  uint8_t segmentCount;
+  JPEGSegment segments[JPEG_MAX_SEGMENTS];
+};
+
+/**
+ * A cheap fingerprint of a frame for spotting repeated scenes.  The scan
+ * data is hashed per restart interval into up to JPEG_SCENE_BUCKETS
+ * buckets covering consecutive strips of the image, so a change in one
+ * part of the picture only changes the buckets it falls in.  Images without
+ * restart markers get a single bucket: they either match or they don't.
+ */
+struct JPEGSceneSignature {
+  uint32_t headerHash; // dimensions, type and quant tables
+  uint8_t bucketCount; // 0 until the signature has been computed
+  uint32_t buckets[JPEG_SCENE_BUCKETS];
+};
+
+bool indexJPEGFrame(unsigned char* bytes, uint32_t len, DecodedJPEGFrame* frame);
+bool decodeJPEGfile(BufPtr* start, uint32_t* len, DecodedJPEGFrame* currentFrame, JPEGSceneSignature* signature = nullptr);
+void signJPEGFrame(const DecodedJPEGFrame* frame, JPEGSceneSignature* signature);
+/**
+ * Percentage (0-100) of the picture that differs between two signatures;
+ * 100 if they can't be compared (different size, type or quant tables)
+ */
+uint8_t compareJPEGSignatures(const JPEGSceneSignature* a, const JPEGSceneSignature* b);
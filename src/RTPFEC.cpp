@@ -0,0 +1,135 @@
+/**
+ * ULPFEC packet generation per https://datatracker.ietf.org/doc/html/rfc5109
+ */
+
+#include "AsyncRTSP.h"
+
+#define KRtpHeaderSize 12 // size of the RTP header
+
+static inline uint32_t readUint32(const uint8_t* bytes) {
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+RTPFECEncoder::RTPFECEncoder() {
+  this->groupSize = 0;
+  this->count = 0;
+  this->sequenceNumber = 0;
+  this->protectionLength = 0;
+}
+
+void RTPFECEncoder::setGroupSize(uint8_t k) {
+  this->groupSize = min(k, (uint8_t)RTP_FEC_MAX_GROUP_SIZE);
+  this->count = 0;
+}
+
+uint8_t RTPFECEncoder::getGroupSize() {
+  return this->groupSize;
+}
+
+boolean RTPFECEncoder::isGroupComplete() {
+  return this->count >= this->groupSize;
+}
+
+boolean RTPFECEncoder::hasPendingPackets() {
+  return this->count > 0;
+}
+
+void RTPFECEncoder::addPacket(const uint8_t* rtpPacket, size_t length) {
+  if (length < KRtpHeaderSize) {
+    return;
+  }
+  size_t payloadLength = min(length - KRtpHeaderSize, sizeof(this->payloadRecovery));
+  const uint8_t* payload = rtpPacket + KRtpHeaderSize;
+  uint16_t seq = (rtpPacket[2] << 8) | rtpPacket[3];
+
+  if (this->count == 0) {
+    this->baseSequenceNumber = seq;
+    this->mask = 0;
+    this->headerRecovery[0] = 0;
+    this->headerRecovery[1] = 0;
+    this->timestampRecovery = 0;
+    this->lengthRecovery = 0;
+    // shorter payloads are treated as zero padded, so clear what we will XOR into
+    memset(this->payloadRecovery, 0, this->protectionLength);
+    this->protectionLength = 0;
+  }
+  if (this->protectionLength < payloadLength) {
+    memset(this->payloadRecovery + this->protectionLength, 0, payloadLength - this->protectionLength);
+    this->protectionLength = payloadLength;
+  }
+
+  this->headerRecovery[0] ^= rtpPacket[0];
+  this->headerRecovery[1] ^= rtpPacket[1];
+  this->timestamp = readUint32(rtpPacket + 4);
+  this->timestampRecovery ^= this->timestamp;
+  this->lengthRecovery ^= payloadLength;
+  this->mask |= 0x8000 >> (uint16_t)(seq - this->baseSequenceNumber);
+
+  // XOR a word at a time; the camera frame buffers carry no alignment guarantees
+  size_t i = 0;
+  for (; i + 4 <= payloadLength; i += 4) {
+    uint32_t a, b;
+    memcpy(&a, this->payloadRecovery + i, 4);
+    memcpy(&b, payload + i, 4);
+    a ^= b;
+    memcpy(this->payloadRecovery + i, &a, 4);
+  }
+  for (; i < payloadLength; i++) {
+    this->payloadRecovery[i] ^= payload[i];
+  }
+
+  this->count++;
+}
+
+size_t RTPFECEncoder::buildPacket(char* buffer, size_t size) {
+  size_t packetSize = 4 + KRtpHeaderSize + KFecHeaderSize + KFecLevelHeaderSize + this->protectionLength;
+  if (packetSize > size || this->count == 0) {
+    this->count = 0;
+    return 0;
+  }
+  uint8_t* buf = (uint8_t*)buffer;
+
+  // Rtp over Rtsp header, matching the media buffers
+  buf[0] = '$';
+  buf[1] = 0;
+  buf[2] = ((packetSize - 4) & 0xFF00) >> 8;
+  buf[3] = ((packetSize - 4) & 0x00FF);
+
+  // RTP header of the parity packet itself
+  buf[4] = 0x80; // RTP version
+  buf[5] = RTP_FEC_PAYLOAD_TYPE;
+  buf[6] = this->sequenceNumber >> 8;
+  buf[7] = this->sequenceNumber & 0xFF;
+  buf[8] = (this->timestamp & 0xFF000000) >> 24; // per section 9, the timestamp of the media it protects
+  buf[9] = (this->timestamp & 0x00FF0000) >> 16;
+  buf[10] = (this->timestamp & 0x0000FF00) >> 8;
+  buf[11] = (this->timestamp & 0x000000FF);
+  buf[12] = (RTP_FEC_SSRC & 0xFF000000) >> 24;
+  buf[13] = (RTP_FEC_SSRC & 0x00FF0000) >> 16;
+  buf[14] = (RTP_FEC_SSRC & 0x0000FF00) >> 8;
+  buf[15] = (RTP_FEC_SSRC & 0x000000FF);
+
+  // FEC header: E=0, L=0, then the recovery fields
+  buf[16] = this->headerRecovery[0] & 0x3F; // P, X and CC recovery
+  buf[17] = this->headerRecovery[1];        // M and PT recovery
+  buf[18] = this->baseSequenceNumber >> 8;  // SN base
+  buf[19] = this->baseSequenceNumber & 0xFF;
+  buf[20] = (this->timestampRecovery & 0xFF000000) >> 24;
+  buf[21] = (this->timestampRecovery & 0x00FF0000) >> 16;
+  buf[22] = (this->timestampRecovery & 0x0000FF00) >> 8;
+  buf[23] = (this->timestampRecovery & 0x000000FF);
+  buf[24] = this->lengthRecovery >> 8;
+  buf[25] = this->lengthRecovery & 0xFF;
+
+  // ULP level 0 header; a single level protecting the whole payload
+  buf[26] = this->protectionLength >> 8;
+  buf[27] = this->protectionLength & 0xFF;
+  buf[28] = this->mask >> 8;
+  buf[29] = this->mask & 0xFF;
+
+  memcpy(buf + 30, this->payloadRecovery, this->protectionLength);
+
+  this->sequenceNumber++;
+  this->count = 0;
+  return packetSize;
+}
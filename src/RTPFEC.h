@@ -0,0 +1,60 @@
+/**
+ * Forward error correction for the RTP/JPEG stream
+ *   ULPFEC: https://datatracker.ietf.org/doc/html/rfc5109
+ *
+ * Losing any single fragment of a JPEG frame makes the whole frame
+ * useless to the client, and there is no time to retransmit it.  With FEC
+ * enabled we send one XOR parity packet per group of up to K media
+ * fragments, so the client can rebuild any one lost fragment of a group.
+ */
+
+#pragma once
+#include <Arduino.h>
+
+#define RTP_FEC_PAYLOAD_TYPE 127  // dynamic payload type, announced as ulpfec/90000 in the SDP
+#define RTP_FEC_SSRC 0x13f97e68   // the parity stream gets its own SSRC and sequence numbers
+#define RTP_FEC_MAX_GROUP_SIZE 16 // the short ULP mask (L=0) covers 16 packets
+
+#define KFecHeaderSize 10      // RFC 5109 section 7.3
+#define KFecLevelHeaderSize 4  // RFC 5109 section 7.4, with L=0
+
+/**
+ * Builds ULPFEC parity packets incrementally: each media packet is folded
+ * into the running XOR as soon as it has been prepared, so generating the
+ * parity needs no extra pass over the frame.
+ */
+class RTPFECEncoder {
+  public:
+    RTPFECEncoder();
+    /**
+     * Number of media packets protected by each parity packet;
+     * 0 disables FEC, values above RTP_FEC_MAX_GROUP_SIZE are clamped
+     */
+    void setGroupSize(uint8_t k);
+    uint8_t getGroupSize();
+    /**
+     * Fold a media packet (12 byte RTP header followed by the payload) into the current group
+     */
+    void addPacket(const uint8_t* rtpPacket, size_t length);
+    boolean isGroupComplete();
+    boolean hasPendingPackets();
+    /**
+     * Write the parity packet for the current group into buffer, behind the same
+     * 4 byte interleaved header the media buffers carry, and start a new group.
+     * Returns the total number of bytes written, or 0 if it doesn't fit.
+     */
+    size_t buildPacket(char* buffer, size_t size);
+
+  private:
+    uint8_t groupSize;
+    uint8_t count;
+    uint16_t sequenceNumber;
+    uint16_t baseSequenceNumber;
+    uint16_t mask;
+    uint8_t headerRecovery[2];   // P, X, CC and M, PT bits of the protected headers
+    uint32_t timestampRecovery;
+    uint32_t timestamp;          // timestamp of the last protected packet
+    uint16_t lengthRecovery;
+    uint16_t protectionLength;   // length of the longest protected payload
+    uint8_t payloadRecovery[RTSP_MAX_PACKET_SIZE];
+};
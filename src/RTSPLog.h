@@ -0,0 +1,77 @@
+/**
+ * Logging for the RTSP server.
+ *
+ * Log statements go through the RTSP_LOG* macros below.  Levels above
+ * RTSP_LOG_LEVEL compile to nothing, so their arguments are never evaluated.
+ * Enabled statements don't format anything on the calling task: they copy the
+ * format string pointer and up to RTSP_LOG_MAX_ARGS integer arguments into a
+ * fixed ring of RTSPLogEntry records, and AsyncRTSPServer::processLog()
+ * formats and delivers them later from a low priority context (the Arduino
+ * loop, for example).
+ *
+ * Because formatting is deferred:
+ *  - the format must be a string literal (only the pointer is kept)
+ *  - arguments must be integers; print floats as fixed point
+ *  - the optional text argument (the *_S macros) is copied, truncated to
+ *    RTSP_LOG_TEXT_SIZE - 1 characters, and must be the first conversion (%s)
+ */
+
+#pragma once
+#include <Arduino.h>
+
+#define RTSP_LOG_LEVEL_NONE 0
+#define RTSP_LOG_LEVEL_ERROR 1
+#define RTSP_LOG_LEVEL_WARN 2
+#define RTSP_LOG_LEVEL_INFO 3
+#define RTSP_LOG_LEVEL_DEBUG 4
+
+#ifndef RTSP_LOG_LEVEL
+#define RTSP_LOG_LEVEL RTSP_LOG_LEVEL_INFO
+#endif
+#ifndef RTSP_LOG_QUEUE_SIZE
+#define RTSP_LOG_QUEUE_SIZE 16 // entries; when full new entries are counted and dropped
+#endif
+#define RTSP_LOG_MAX_ARGS 6
+#define RTSP_LOG_TEXT_SIZE 16
+
+struct RTSPLogEntry {
+  const char* format;
+  uint8_t level;
+  bool hasText;
+  char text[RTSP_LOG_TEXT_SIZE];
+  uint32_t args[RTSP_LOG_MAX_ARGS];
+};
+
+#define RTSP_LOG_IP_ARGS(ip) (ip)[0], (ip)[1], (ip)[2], (ip)[3]
+
+#if RTSP_LOG_LEVEL >= RTSP_LOG_LEVEL_ERROR
+#define RTSP_LOGE(server, format, ...) (server)->queueLog(RTSP_LOG_LEVEL_ERROR, format, nullptr, ##__VA_ARGS__)
+#define RTSP_LOGE_S(server, format, text, ...) (server)->queueLog(RTSP_LOG_LEVEL_ERROR, format, text, ##__VA_ARGS__)
+#else
+#define RTSP_LOGE(server, format, ...) do {} while (0)
+#define RTSP_LOGE_S(server, format, text, ...) do {} while (0)
+#endif
+
+#if RTSP_LOG_LEVEL >= RTSP_LOG_LEVEL_WARN
+#define RTSP_LOGW(server, format, ...) (server)->queueLog(RTSP_LOG_LEVEL_WARN, format, nullptr, ##__VA_ARGS__)
+#define RTSP_LOGW_S(server, format, text, ...) (server)->queueLog(RTSP_LOG_LEVEL_WARN, format, text, ##__VA_ARGS__)
+#else
+#define RTSP_LOGW(server, format, ...) do {} while (0)
+#define RTSP_LOGW_S(server, format, text, ...) do {} while (0)
+#endif
+
+#if RTSP_LOG_LEVEL >= RTSP_LOG_LEVEL_INFO
+#define RTSP_LOGI(server, format, ...) (server)->queueLog(RTSP_LOG_LEVEL_INFO, format, nullptr, ##__VA_ARGS__)
+#define RTSP_LOGI_S(server, format, text, ...) (server)->queueLog(RTSP_LOG_LEVEL_INFO, format, text, ##__VA_ARGS__)
+#else
+#define RTSP_LOGI(server, format, ...) do {} while (0)
+#define RTSP_LOGI_S(server, format, text, ...) do {} while (0)
+#endif
+
+#if RTSP_LOG_LEVEL >= RTSP_LOG_LEVEL_DEBUG
+#define RTSP_LOGD(server, format, ...) (server)->queueLog(RTSP_LOG_LEVEL_DEBUG, format, nullptr, ##__VA_ARGS__)
+#define RTSP_LOGD_S(server, format, text, ...) (server)->queueLog(RTSP_LOG_LEVEL_DEBUG, format, text, ##__VA_ARGS__)
+#else
+#define RTSP_LOGD(server, format, ...) do {} while (0)
+#define RTSP_LOGD_S(server, format, text, ...) do {} while (0)
+#endif